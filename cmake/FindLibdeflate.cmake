@@ -0,0 +1,24 @@
+# - Try to find libdeflate
+# Once done this will define
+#  LIBDEFLATE_FOUND - System has libdeflate
+#  LIBDEFLATE_INCLUDE_DIRS - The libdeflate include directories
+#  LIBDEFLATE_LIBRARIES - The libraries needed to use libdeflate
+
+find_package(PkgConfig)
+pkg_check_modules(PC_LIBDEFLATE QUIET libdeflate)
+
+find_path(LIBDEFLATE_INCLUDE_DIR libdeflate.h
+    HINTS ${PC_LIBDEFLATE_INCLUDEDIR} ${PC_LIBDEFLATE_INCLUDE_DIRS})
+
+find_library(LIBDEFLATE_LIBRARY NAMES deflate libdeflate
+    HINTS ${PC_LIBDEFLATE_LIBDIR} ${PC_LIBDEFLATE_LIBRARY_DIRS})
+
+include(FindPackageHandleStandardArgs)
+# handle the QUIETLY and REQUIRED arguments and set LIBDEFLATE_FOUND to TRUE
+# if all listed variables are TRUE
+find_package_handle_standard_args(Libdeflate DEFAULT_MSG LIBDEFLATE_LIBRARY LIBDEFLATE_INCLUDE_DIR)
+
+mark_as_advanced(LIBDEFLATE_INCLUDE_DIR LIBDEFLATE_LIBRARY)
+
+set(LIBDEFLATE_LIBRARIES ${LIBDEFLATE_LIBRARY})
+set(LIBDEFLATE_INCLUDE_DIRS ${LIBDEFLATE_INCLUDE_DIR})
@@ -0,0 +1,24 @@
+# - Try to find zlib-ng with its native API
+# Once done this will define
+#  ZLIBNG_FOUND - System has zlib-ng
+#  ZLIBNG_INCLUDE_DIRS - The zlib-ng include directories
+#  ZLIBNG_LIBRARIES - The libraries needed to use zlib-ng
+
+find_package(PkgConfig)
+pkg_check_modules(PC_ZLIBNG QUIET zlib-ng)
+
+find_path(ZLIBNG_INCLUDE_DIR zlib-ng.h
+    HINTS ${PC_ZLIBNG_INCLUDEDIR} ${PC_ZLIBNG_INCLUDE_DIRS})
+
+find_library(ZLIBNG_LIBRARY NAMES z-ng libz-ng
+    HINTS ${PC_ZLIBNG_LIBDIR} ${PC_ZLIBNG_LIBRARY_DIRS})
+
+include(FindPackageHandleStandardArgs)
+# handle the QUIETLY and REQUIRED arguments and set ZLIBNG_FOUND to TRUE
+# if all listed variables are TRUE
+find_package_handle_standard_args(ZLIBNG DEFAULT_MSG ZLIBNG_LIBRARY ZLIBNG_INCLUDE_DIR)
+
+mark_as_advanced(ZLIBNG_INCLUDE_DIR ZLIBNG_LIBRARY)
+
+set(ZLIBNG_LIBRARIES ${ZLIBNG_LIBRARY})
+set(ZLIBNG_INCLUDE_DIRS ${ZLIBNG_INCLUDE_DIR})
@@ -0,0 +1,31 @@
+#pragma once
+#include <QtCore/QtGlobal>
+
+
+
+namespace Saints {
+
+// Inflate implementations for v6 and v10 archives
+enum class DeflateBackend
+{
+    Zlib,
+    ZlibNg,
+    Libdeflate // Whole buffers only, streams use zlib-ng or zlib
+};
+
+bool isDeflateBackendAvailable(DeflateBackend backend);
+// Defaults to the fastest backend the library was built with
+DeflateBackend getDeflateBackend();
+void setDeflateBackend(DeflateBackend backend);
+
+// Codec contexts are kept per thread and reset between calls
+struct DecompressionStats
+{
+    qint64 contexts_created;
+    qint64 contexts_reused;
+};
+
+DecompressionStats getDecompressionStats();
+void resetDecompressionStats();
+
+}
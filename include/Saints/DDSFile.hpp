@@ -7,6 +7,8 @@
 
 namespace Saints {
 
+class ByteReader;
+class ByteWriter;
 struct DDSPixelformat;
 enum class TextureFormat;
 
@@ -102,7 +104,9 @@ TextureFormat detectPixelformat(const DDSPixelformat& ddspf);
 struct DDSPixelformat
 {
     void read(QIODevice& stream);
+    void read(ByteReader& reader);
     void write(QIODevice& stream) const;
+    void write(ByteWriter& writer) const;
 
     quint32 flags;
     quint32 four_cc; // Four character code for format identification
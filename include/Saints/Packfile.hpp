@@ -4,60 +4,199 @@
 #include <QtCore/QString>
 #include <QtCore/QIODevice>
 #include <QtCore/QVector>
+#include <QtCore/QHash>
+#include <QtCore/QSet>
+#include <QtCore/QMutex>
+#include <QtCore/QWaitCondition>
+#include <QtCore/QAtomicInt>
+#include <QtCore/QFile>
+#include <QtCore/QBuffer>
+#include <memory>
+#include <functional>
 
 #include "PackfileEntry.hpp"
+#include "PackfileCache.hpp"
 
 
 
 namespace Saints {
 
 class PackfileEntry;
+class PackfileWriter;
+class ByteReader;
+struct InflateCheckpoint;
+struct InflateIndex;
+
+constexpr quint32 PACKFILE_DESCRIPTOR = 0x51890ACE;
+
+constexpr qint64 PACKFILE_HEADER_SIZE_6 = 380;
+constexpr qint64 PACKFILE_HEADER_SIZE_10 = 40;
+constexpr qint64 PACKFILE_HEADER_SIZE_17 = 120;
+
+// Decompressed bytes between checkpoints of condensed data indices
+constexpr qint64 CONDENSED_INDEX_INTERVAL = 1024 * 1024;
 
 class Packfile
 {
+    friend PackfileWriter;
+    friend PackfileEntry;
+
 public:
     enum Flags {
         Compressed = (1 << 0),
         Condensed = (1 << 1)
     };
 
+    // Receives extracted entry data, always called on the calling thread
+    typedef std::function<void(PackfileEntry& entry, const PackfileData& data)> EntrySink;
+
+    struct EntryVerification
+    {
+        quint32 crc32; // Of the decompressed data
+        qint64 size; // Decompressed bytes
+        QString error; // Empty if the entry decompressed cleanly
+    };
+
+    struct Verification
+    {
+        QVector<QString> errors; // Problems with the header and layout
+        QVector<EntryVerification> entries; // In directory order
+        bool isValid() const;
+    };
+
+    struct IndexStats
+    {
+        int filename_keys; // Unique filenames in the index
+        int filepath_keys; // Unique directory + filename paths in the index
+        int buckets; // Allocated hash buckets of both indices
+    };
+
     Packfile();
-    Packfile(QIODevice& stream);
+    Packfile(QIODevice& stream, bool lazy = false);
     Packfile(const Packfile& other) = delete;
     Packfile& operator=(const Packfile& other) = delete;
-
-    void open(QIODevice& stream);
+    ~Packfile();
+
+    // Entries can be loaded from multiple threads. Files are read with
+    // positional reads where possible, other devices are locked.
+    // Lazy opens only parse the header, directory records are decoded when
+    // an entry is first accessed and all of them on the first name lookup.
+    void open(QIODevice& stream, bool lazy = false);
+    // Maps the file into memory. Uncompressed entry data is returned as
+    // views into the mapping and stays valid as long as the Packfile.
+    void openMapped(const QString& path, bool lazy = false);
+    bool isMapped() const;
+    bool isLazy() const;
+    // Console archives, detected from the descriptor
+    bool isBigEndian() const;
     void load();
-    void loadFileData(PackfileEntry& entry);
+    PackfileData loadFileData(PackfileEntry& entry);
+    void loadFileData(const QVector<PackfileEntry*>& entries, int num_threads = 0);
+    // Reads entries in file order and decompresses them on num_threads
+    // threads (0 = one per core). Only a limited batch is kept in memory.
+    void extract(const QVector<PackfileEntry*>& entries, const EntrySink& sink,
+        int num_threads = 0);
+    void extractAll(const EntrySink& sink, int num_threads = 0);
+    // Writes the entry data to sink in fixed size chunks without loading
+    // the whole entry into memory
+    void extractTo(const PackfileEntry& entry, QIODevice& sink);
+    // Checks the header fields and offsets and decompresses every entry
+    // into a CRC-32 on num_threads threads, without keeping the data. The
+    // header checksum algorithm is unknown and isn't checked.
+    Verification verify(int num_threads = 0);
     PackfileEntry* getEntryByFilename(const QString& filename);
     const PackfileEntry* getEntryByFilename(const QString& filename) const;
+    PackfileEntry* getEntryByFilepath(const QString& filepath);
+    const PackfileEntry* getEntryByFilepath(const QString& filepath) const;
+    IndexStats getIndexStats() const;
     PackfileEntry& getEntry(int index);
     const PackfileEntry& getEntry(int index) const;
+    // Renaming entries keeps the name lookups current, entries shouldn't be
+    // added or removed through the vector
     QVector<PackfileEntry>& getEntries();
     const QVector<PackfileEntry>& getEntries() const;
     int getEntriesCount() const;
 
+    PackfileCache* getCache() const;
+    // Uses a shared cache instead of the packfile's own unlimited one,
+    // nullptr switches back
+    void setCache(PackfileCache* cache);
+
     int getVersion() const;
     void setVersion(int value);
     int getFlags() const;
     void setFlags(int value);
     qint64 getTimestamp() const;
     void setTimestamp(qint64 value);
+    // Stop inflating condensed archives after the requested entry instead of
+    // decompressing the whole data block on the first access. Once an entry
+    // lies past the inflated prefix the whole block is decompressed.
+    bool getPartialCondensedLoading() const;
+    void setPartialCondensedLoading(bool value);
+    // Checkpoints into the data of condensed zlib archives (v6 and v10).
+    // Single entries are inflated from the closest checkpoint before them
+    // instead of the start of the data. Indices can be saved as sidecar
+    // files and are only valid for the archive they were built from.
+    void buildCondensedIndex(qint64 interval = CONDENSED_INDEX_INTERVAL);
+    void saveCondensedIndex(QIODevice& stream) const;
+    void loadCondensedIndex(QIODevice& stream);
+    bool hasCondensedIndex() const;
+    void clearCondensedIndex();
 
 private:
-    void loadHeader6();
-    void loadHeader10();
-    void loadHeader17();
-
+    typedef std::function<void(const char* data, qint64 size)> ChunkSink;
+
+    int loadHeader6(ByteReader& reader);
+    int loadHeader10(ByteReader& reader);
+    int loadHeader17(ByteReader& reader);
+    void loadDirectory();
+    void loadEntry(int index);
+    void loadNames();
+    void decodeEntry(int index, ByteReader& reader);
+    void buildIndex();
+    void updateIndex();
+    void invalidateIndex(const PackfileEntry& entry);
+    QByteArray loadCondensedData(qint64 limit);
+    PackfileData readEntryData(const PackfileEntry& entry);
+    static QString indexKey(const QString& name);
+
+    qint64 getEntrySize();
     qint64 getEntriesOffset();
     qint64 getEntryNamesOffset();
     qint64 getDataOffset();
-
-    QByteArray decompressStream(QIODevice& stream);
+    static qint64 calcEntriesOffset(int version);
+    static qint64 calcEntryNamesOffset(int version, qint64 dir_size);
+    static qint64 calcDataOffset(int version, qint64 dir_size, qint64 filename_size);
+
+    // out_size is the known decompressed size, -1 if unknown
+    QByteArray decompressBuffer(const QByteArray& compressed, qint64 limit = -1,
+        qint64 out_size = -1, int num_threads = 1);
+    QByteArray decompressRegion(qint64 offset, qint64 size, qint64 limit = -1,
+        qint64 out_size = -1);
+    QByteArray readRegion(qint64 offset, qint64 size);
+    std::function<qint64(char* data, qint64 size)> readRegionChunks(qint64 offset, qint64 end);
+    // Streams [out_start, out_start + out_size) of the decompressed region
+    // to sink, starting at point if given
+    void decompressRange(qint64 in_pos, qint64 in_end, const InflateCheckpoint* point,
+        qint64 out_start, qint64 out_size, const ChunkSink& sink);
+    // Decompresses the stream in [in_pos, in_end), which has to end exactly at in_end
+    void decompressAll(qint64 in_pos, qint64 in_end, const ChunkSink& sink);
+    void verifyLayout(QVector<QString>& errors);
+    void verifyEntry(const PackfileEntry& entry, EntryVerification& result);
+    void verifyCondensed(Verification& result);
 
     QIODevice* m_stream;
+    QMutex m_stream_mutex;
+    int m_file_handle; // File descriptor for positional reads, -1 if none
+    std::unique_ptr<QFile> m_map_file;
+    std::unique_ptr<QBuffer> m_map_buffer;
+    QByteArray m_map_header;
+    const char* m_map;
+    qint64 m_map_size;
+    bool m_lazy;
 
     int m_version;
+    bool m_big_endian;
     quint32 m_header_checksum;
     qint64 m_file_size;
 
@@ -72,7 +211,27 @@ private:
     qint64 m_data_offset;
 
     QVector<PackfileEntry> m_entries;
-    bool m_condensed_cached;
+    // Lazily decoded directory, guarded by m_directory_mutex until complete
+    QVector<bool> m_entries_loaded;
+    QByteArray m_names;
+    bool m_names_loaded;
+    QAtomicInt m_directory_loaded;
+    QMutex m_directory_mutex;
+    // Lowercase names to entry index, names are case insensitive in game
+    QHash<QString, int> m_filename_index;
+    QHash<QString, int> m_filepath_index;
+    QAtomicInt m_index_stale; // An entry was renamed after buildIndex
+    std::unique_ptr<PackfileCache> m_own_cache;
+    PackfileCache* m_cache;
+    // Indices of entries that are being loaded by some thread
+    QSet<int> m_loading;
+    QMutex m_loading_mutex;
+    QWaitCondition m_loading_done;
+    // Serializes inflating condensed data, which is kept in the cache
+    mutable QMutex m_condensed_mutex;
+    std::shared_ptr<const InflateIndex> m_condensed_index;
+    bool m_partial_condensed;
+    bool m_partial_condensed_missed; // A partial prefix was too short before
 };
 
 }
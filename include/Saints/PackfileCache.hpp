@@ -0,0 +1,89 @@
+#pragma once
+#include <QtCore/QtGlobal>
+#include <QtCore/QByteArray>
+#include <QtCore/QHash>
+#include <QtCore/QMutex>
+#include <QtCore/QPair>
+#include <list>
+
+#include "PackfileData.hpp"
+
+
+namespace Saints {
+
+class Packfile;
+
+// Byte budgeted LRU cache for entry data. One cache can be shared by
+// multiple packfiles, it has to outlive all of them. Entries are identified
+// by their packfile and directory index, so copies of an entry share the
+// cached data. Condensed archives also keep their whole decompressed data as
+// one item, with a smaller budget every entry inflates it again. Items that
+// are slices of the same buffer count its size once, evicting the whole
+// buffer item frees nothing while its slices are still cached.
+class PackfileCache
+{
+public:
+    struct Stats
+    {
+        qint64 hits;
+        qint64 misses;
+        qint64 evictions;
+        qint64 size; // Bytes of cached data
+        qint64 budget; // Maximum bytes of cached data, -1 is unlimited
+        int items;
+        int pinned_items;
+    };
+
+    explicit PackfileCache(qint64 budget = -1);
+    PackfileCache(const PackfileCache& other) = delete;
+    PackfileCache& operator=(const PackfileCache& other) = delete;
+
+    bool lookup(const Packfile* packfile, int index, PackfileData& data);
+    bool contains(const Packfile* packfile, int index) const;
+    void insert(const Packfile* packfile, int index, const PackfileData& data);
+    void release(const Packfile* packfile, int index);
+    void releasePackfile(const Packfile* packfile);
+    void clear();
+    // Pinned entries are not evicted until they are unpinned or released
+    bool pin(const Packfile* packfile, int index);
+    void unpin(const Packfile* packfile, int index);
+
+    qint64 getBudget() const;
+    void setBudget(qint64 value);
+    Stats getStats() const;
+    void resetStats();
+
+private:
+    typedef QPair<const Packfile*, int> Key;
+
+    struct Item
+    {
+        Key key;
+        PackfileData data;
+        int pins;
+    };
+    typedef std::list<Item>::iterator ItemIterator;
+
+    struct Buffer
+    {
+        int refs;
+        qint64 size;
+    };
+
+    void evict();
+    void removeItem(ItemIterator it);
+    void addBuffer(const PackfileData& data);
+    void removeBuffer(const PackfileData& data);
+
+    mutable QMutex m_mutex;
+    std::list<Item> m_items; // Most recently used first
+    QHash<Key, ItemIterator> m_lookup;
+    QHash<const char*, Buffer> m_buffers; // Items referencing each buffer
+    qint64 m_budget;
+    qint64 m_size;
+    qint64 m_hits;
+    qint64 m_misses;
+    qint64 m_evictions;
+};
+
+}
@@ -0,0 +1,35 @@
+#pragma once
+#include <QtCore/QtGlobal>
+#include <QtCore/QByteArray>
+
+
+
+namespace Saints {
+
+// Entry data as a range of a shared buffer. Entries of condensed archives
+// are slices of the archive's decompressed data, they keep the whole buffer
+// alive instead of copying their part out of it.
+class PackfileData
+{
+public:
+    PackfileData();
+    PackfileData(const QByteArray& data);
+    PackfileData(const QByteArray& buffer, qint64 offset, qint64 size);
+
+    const char* constData() const;
+    qint64 size() const;
+    bool isEmpty() const;
+    // The buffer the data lies in and the data's position in it
+    const QByteArray& getBuffer() const;
+    qint64 getOffset() const;
+    // Shares the buffer if the data covers all of it, copies slices
+    QByteArray toByteArray() const;
+    operator QByteArray() const;
+
+private:
+    QByteArray m_buffer;
+    qint64 m_offset;
+    qint64 m_size;
+};
+
+}
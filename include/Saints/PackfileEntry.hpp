@@ -4,15 +4,24 @@
 #include <QtCore/QString>
 #include <QtCore/QIODevice>
 
+#include "PackfileData.hpp"
+
 
 
 namespace Saints {
 
 class Packfile;
+class ByteReader;
+
+// Directory record sizes, including the name offsets
+constexpr qint64 PACKFILE_ENTRY_SIZE_6 = 20;
+constexpr qint64 PACKFILE_ENTRY_SIZE_10 = 24;
+constexpr qint64 PACKFILE_ENTRY_SIZE_17 = 48;
 
 class PackfileEntry
 {
     friend Packfile;
+    friend struct PackfileEntryLayout;
 
 public:
     enum Flags {
@@ -25,7 +34,17 @@ public:
     void load6(QIODevice& stream);
     void load10(QIODevice& stream);
     void load17(QIODevice& stream);
-    QByteArray& getData();
+    void load6(ByteReader& reader);
+    void load10(ByteReader& reader);
+    void load17(ByteReader& reader);
+    // Data of mapped archives points into the mapping and stays valid while
+    // the Packfile is open. Entries of condensed archives share the
+    // archive's decompressed data.
+    PackfileData getData();
+    bool isCached() const;
+    void release();
+    void pin();
+    void unpin();
     QString getFilepath() const;
     void setFilepath(const QString& value);
 
@@ -45,7 +64,10 @@ public:
     void setAlignment(int value);
 
 private:
+    void nameChanged();
+
     Packfile* m_packfile;
+    int m_index; // Position in the directory, identifies the entry in caches
 
     qint64 m_start;
     qint64 m_size;
@@ -55,8 +77,6 @@ private:
 
     QString m_filename;
     QString m_filepath;
-    QByteArray m_data_cache;
-    bool m_is_cached;
 };
 
 }
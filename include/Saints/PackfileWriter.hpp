@@ -0,0 +1,73 @@
+#pragma once
+#include <QtCore/QtGlobal>
+#include <QtCore/QByteArray>
+#include <QtCore/QString>
+#include <QtCore/QIODevice>
+#include <QtCore/QVector>
+
+
+
+namespace Saints {
+
+class PackfileWriter
+{
+public:
+    PackfileWriter();
+    PackfileWriter(int version, int flags);
+
+    // Directories are separated with a backslash and only stored by v17
+    void addEntry(const QString& filepath, const QByteArray& data, int alignment = 16);
+    // Output has to be seekable, the directory is written after the data.
+    // The v10 and v17 header checksum is written as 0, its algorithm is
+    // unknown. Packfile reads it without checking it, the game's handling
+    // of it hasn't been verified.
+    void write(QIODevice& stream) const;
+    int getEntriesCount() const;
+    void clear();
+
+    int getVersion() const;
+    void setVersion(int value);
+    int getFlags() const;
+    void setFlags(int value);
+    qint64 getTimestamp() const;
+    void setTimestamp(qint64 value);
+    int getCompressionLevel() const;
+    void setCompressionLevel(int value);
+    int getThreadCount() const;
+    void setThreadCount(int value);
+    // Writes numbers in console byte order
+    bool isBigEndian() const;
+    void setBigEndian(bool value);
+
+private:
+    struct Item
+    {
+        QString filename;
+        QString directory;
+        QByteArray data;
+        int alignment;
+    };
+
+    struct Record
+    {
+        qint64 filename_offset;
+        qint64 filepath_offset;
+        qint64 start;
+        qint64 size;
+        qint64 compressed_size;
+        int flags;
+        int alignment;
+    };
+
+    QByteArray compressData(const QByteArray& data) const;
+
+    int m_version;
+    int m_flags;
+    qint64 m_timestamp;
+    int m_compression_level;
+    int m_num_threads;
+    bool m_big_endian;
+    QVector<Item> m_items;
+};
+
+}
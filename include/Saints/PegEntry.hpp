@@ -10,6 +10,8 @@
 
 namespace Saints {
 
+class ByteReader;
+class ByteWriter;
 class DDSFile;
 class PegFile;
 class TGAFile;
@@ -58,6 +60,7 @@ TextureFormat getFormatId(QString name);
 QStringList getEntryFlagNames(int flags);
 
 constexpr qint64 PEGENTRY_BINSIZE = 72;
+constexpr qint64 PEGENTRY_BINSIZE_19 = 104;
 class PegEntry
 {
     friend PegFile;
@@ -67,12 +70,19 @@ public:
     PegEntry(PegFile& parent);
     void read13(QIODevice& stream);
     void read19(QIODevice& stream);
+    void read13(ByteReader& reader);
+    void read19(ByteReader& reader);
     void write13(QIODevice& stream, qint64 data_offset) const;
     void write19(QIODevice& stream, qint64 data_offset) const;
+    void write13(ByteWriter& writer, qint64 data_offset) const;
+    void write19(ByteWriter& writer, qint64 data_offset) const;
     void fromDDS(const DDSFile& ddsfile);
-    void fromTGA(const TGAFile& tgafile, TextureFormat fmt);
+    // Builds the full mip chain, filtered in linear space unless flags has
+    // BM_F_LINEAR_COLOR_SPACE. Blocks are encoded on num_threads threads,
+    // 0 uses one per core.
+    void fromTGA(const TGAFile& tgafile, TextureFormat fmt, int num_threads = 0);
     DDSFile toDDS() const;
-    TGAFile toTGA() const;
+    TGAFile toTGA(int num_threads = 0) const;
 
     qint64 offset; // File position of texture data
     int width; // Width of texture
@@ -89,8 +99,8 @@ public:
     int mip_levels; // Number of mipmaps in texture + 1 for the base image.
     qint64 data_size; // Size of the texture data.
     HDRColor avg_color;
-    int num_mips_split;
-    quint32 data_max_size;
+    int num_mips_split; // Mips stored apart from data, 0 after fromDDS/fromTGA
+    quint32 data_max_size; // Size of the whole mip chain, data.size() after fromDDS/fromTGA
 
     PegFile* m_parent;
     QString filename;
@@ -35,6 +35,7 @@ public:
     quint32 data_size; // Size of the data file.
     quint16 flags; // Always 0
     quint16 alignment; // Always 16 for the PC
+    bool big_endian; // Console files, detected from the signature
     QVector<PegEntry> entries;
 
 private:
@@ -1,3 +1,5 @@
+#include <assert.h>
+#include <string.h>
 #include <QtCore/QtGlobal>
 #include <QtCore/QByteArray>
 #include <QtCore/QString>
@@ -11,32 +13,87 @@
 
 namespace Saints {
 
+constexpr qint64 WRITE_BUFFER_SIZE = 64 * 1024;
+
 ByteReader::ByteReader(QIODevice& stream) :
-    m_stream(stream)
+    m_stream(&stream),
+    m_data(nullptr),
+    m_size(0),
+    m_pos(0),
+    m_big_endian(false)
+{
+
+}
+
+ByteReader::ByteReader(const char* data, qint64 size) :
+    m_stream(nullptr),
+    m_data(data),
+    m_size(size),
+    m_pos(0),
+    m_big_endian(false)
+{
+
+}
+
+ByteReader::ByteReader(const QByteArray& data) :
+    ByteReader(data.constData(), data.size())
 {
 
 }
 
+bool ByteReader::isBigEndian() const
+{
+    return m_big_endian;
+}
+
+void ByteReader::setBigEndian(bool value)
+{
+    m_big_endian = value;
+}
+
 void ByteReader::seek(qint64 pos)
 {
-    m_stream.seek(pos);
+    if (m_stream) {
+        m_stream->seek(pos);
+        return;
+    }
+
+    if (pos < 0 || pos > m_size) {
+        throw IOError(QString("Seek to %1 is outside of %2 bytes")
+            .arg(pos).arg(m_size));
+    }
+    m_pos = pos;
 }
 
 qint64 ByteReader::tell() const
 {
-    return m_stream.pos();
+    return m_stream ? m_stream->pos() : m_pos;
 }
 
 void ByteReader::read(char* data, qint64 size)
 {
-    m_stream.read(data, size);
+    if (m_stream) {
+        m_stream->read(data, size);
+        return;
+    }
+
+    checkSpan(size);
+    memcpy(data, m_data + m_pos, size);
+    m_pos += size;
 }
 
 QByteArray ByteReader::read(qint64 size)
 {
+    if (!m_stream) {
+        checkSpan(size);
+        QByteArray buffer(m_data + m_pos, size);
+        m_pos += size;
+        return buffer;
+    }
+
     QByteArray buffer;
     buffer.resize(size);
-    qint64 bytes_read = m_stream.read(buffer.data(), size);
+    qint64 bytes_read = m_stream->read(buffer.data(), size);
     if (bytes_read != size) {
         throw IOError(QString("End of file while reading %1 bytes").arg(size));
     }
@@ -66,21 +123,46 @@ QString ByteReader::readString(qint64 size)
 
 QString ByteReader::readCString(char delim)
 {
+    if (!m_stream) {
+        const char* start = m_data + m_pos;
+        const char* end = static_cast<const char*>(memchr(start, delim, m_size - m_pos));
+        if (end == nullptr) {
+            throw IOError("End of data while reading a string");
+        }
+        // The delimiter is included, like the stream version does
+        qint64 size = end - start + 1;
+        m_pos += size;
+        return QString::fromUtf8(QByteArray::fromRawData(start, size));
+    }
+
     QByteArray buffer;
     char c;
     do {
-        m_stream.getChar(&c);
+        m_stream->getChar(&c);
         buffer.append(c);
     } while (c != delim);
     return QString::fromUtf8(buffer);
 }
 
+void ByteReader::checkSpan(qint64 size) const
+{
+    if (size < 0 || size > m_size - m_pos) {
+        throw IOError(QString("End of data while reading %1 bytes").arg(size));
+    }
+}
+
 template<typename T>
 T ByteReader::read_generic()
 {
     T value;
-    m_stream.read(reinterpret_cast<char*>(&value), sizeof(T));
-    return value;
+    if (m_stream) {
+        m_stream->read(reinterpret_cast<char*>(&value), sizeof(T));
+    } else {
+        checkSpan(sizeof(T));
+        memcpy(&value, m_data + m_pos, sizeof(T));
+        m_pos += sizeof(T);
+    }
+    return m_big_endian ? swapBytes(value) : value;
 }
 
 qint64 ByteReader::readS64()
@@ -151,29 +233,85 @@ double ByteReader::readDouble()
 
 
 ByteWriter::ByteWriter(QIODevice& stream) :
-    m_stream(stream)
+    m_stream(stream),
+    m_buffered(0),
+    m_big_endian(false)
+{
+
+}
+
+ByteWriter::~ByteWriter()
+{
+    if (m_buffered > 0) {
+        m_stream.write(m_buffer.constData(), m_buffered);
+    }
+}
+
+bool ByteWriter::isBigEndian() const
 {
+    return m_big_endian;
+}
 
+void ByteWriter::setBigEndian(bool value)
+{
+    m_big_endian = value;
 }
 
 void ByteWriter::seek(qint64 pos)
 {
+    flush();
     m_stream.seek(pos);
 }
 
 qint64 ByteWriter::tell() const
 {
-    return m_stream.pos();
+    return m_stream.pos() + m_buffered;
+}
+
+void ByteWriter::flush()
+{
+    if (m_buffered > 0) {
+        qint64 size = m_buffered;
+        m_buffered = 0;
+        writeStream(m_buffer.constData(), size);
+    }
 }
 
 void ByteWriter::write(const char* data, qint64 size)
 {
-    m_stream.write(data, size);
+    if (size >= WRITE_BUFFER_SIZE) {
+        // Payloads skip the copy into the buffer
+        flush();
+        writeStream(data, size);
+        return;
+    }
+    memcpy(reserve(size), data, size);
 }
 
 void ByteWriter::write(const QByteArray& data)
 {
-    m_stream.write(data);
+    write(data.constData(), data.size());
+}
+
+char* ByteWriter::reserve(qint64 size)
+{
+    assert(size <= WRITE_BUFFER_SIZE);
+    if (m_buffered + size > WRITE_BUFFER_SIZE) {
+        flush();
+    }
+    if (m_buffer.isEmpty()) {
+        m_buffer.resize(WRITE_BUFFER_SIZE);
+    }
+    char* data = m_buffer.data() + m_buffered;
+    m_buffered += size;
+    return data;
+}
+
+void ByteWriter::writeStream(const char* data, qint64 size)
+{
+    if (m_stream.write(data, size) != size) {
+        throw IOError(QString("Failed to write %1 bytes").arg(size));
+    }
 }
 
 // Additional methods
@@ -181,32 +319,36 @@ void ByteWriter::write(const QByteArray& data)
 void ByteWriter::align(qint64 alignment)
 {
     qint64 current_pos = tell();
-    qint64 to_align = current_pos % alignment;
-    pad(to_align);
+    pad(alignAddress(current_pos, alignment) - current_pos);
 }
 
 void ByteWriter::pad(qint64 size)
 {
-    for (qint64 i = 0; i < size; i++) {
-        m_stream.putChar('\0');
+    while (size > 0) {
+        qint64 count = qMin(size, WRITE_BUFFER_SIZE);
+        memset(reserve(count), 0, count);
+        size -= count;
     }
 }
 
 void ByteWriter::writeString(const QString& str)
 {
-    m_stream.write(str.toUtf8());
+    write(str.toUtf8());
 }
 
 void ByteWriter::writeCString(const QString& str)
 {
-    m_stream.write(str.toUtf8());
-    m_stream.putChar('\0');
+    write(str.toUtf8());
+    *reserve(1) = '\0';
 }
 
 template<typename T>
 void ByteWriter::write_generic(T value)
 {
-    m_stream.write(reinterpret_cast<char*>(&value), sizeof(T));
+    if (m_big_endian) {
+        value = swapBytes(value);
+    }
+    memcpy(reserve(sizeof(T)), &value, sizeof(T));
 }
 
 void ByteWriter::writeS64(qint64 value)
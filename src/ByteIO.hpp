@@ -13,7 +13,14 @@ class ByteReader
 {
 public:
     explicit ByteReader(QIODevice& stream);
+    // Reads from memory with bounds checks, positions are relative to data.
+    // The data has to outlive the reader.
+    ByteReader(const char* data, qint64 size);
+    explicit ByteReader(const QByteArray& data);
 
+    // Numbers are little endian unless set otherwise
+    bool isBigEndian() const;
+    void setBigEndian(bool value);
     void seek(qint64 pos);
     qint64 tell() const;
     void read(char* data, qint64 size);
@@ -40,17 +47,31 @@ public:
     double readDouble();
 
 private:
-    QIODevice& m_stream;
+    void checkSpan(qint64 size) const;
+
+    QIODevice* m_stream;
+    const char* m_data;
+    qint64 m_size;
+    qint64 m_pos;
+    bool m_big_endian;
 };
 
 
+// Small writes are collected in a buffer that is flushed on seek, when it
+// is full and on destruction. Large writes go to the stream directly.
 class ByteWriter
 {
 public:
     explicit ByteWriter(QIODevice& stream);
+    ~ByteWriter();
 
+    bool isBigEndian() const;
+    void setBigEndian(bool value);
     void seek(qint64 pos);
     qint64 tell() const;
+    // Throws IOError if the stream doesn't take all bytes, the destructor
+    // can't report that
+    void flush();
     void write(const char* data, qint64 size);
     void write(const QByteArray& data);
     void align(qint64 alignment);
@@ -75,7 +96,15 @@ public:
     void writeDouble(double value);
 
 private:
+    Q_DISABLE_COPY(ByteWriter)
+
+    char* reserve(qint64 size);
+    void writeStream(const char* data, qint64 size);
+
     QIODevice& m_stream;
+    QByteArray m_buffer;
+    qint64 m_buffered;
+    bool m_big_endian;
 };
 
 }
@@ -0,0 +1,85 @@
+#include <stdexcept>
+#include <QtCore/QtGlobal>
+#include <QtCore/QAtomicInt>
+#include <QtCore/QAtomicInteger>
+
+#include "Saints/Compression.hpp"
+#include "util.hpp"
+
+
+
+namespace Saints {
+
+static DeflateBackend getDefaultDeflateBackend()
+{
+#if defined(SAINTS_HAVE_LIBDEFLATE)
+    return DeflateBackend::Libdeflate;
+#elif defined(SAINTS_HAVE_ZLIB_NG)
+    return DeflateBackend::ZlibNg;
+#else
+    return DeflateBackend::Zlib;
+#endif
+}
+
+static QAtomicInt g_deflate_backend(static_cast<int>(getDefaultDeflateBackend()));
+static QAtomicInteger<qint64> g_contexts_created(0);
+static QAtomicInteger<qint64> g_contexts_reused(0);
+
+bool isDeflateBackendAvailable(DeflateBackend backend)
+{
+    switch (backend) {
+    case DeflateBackend::Zlib:
+        return true;
+    case DeflateBackend::ZlibNg:
+#ifdef SAINTS_HAVE_ZLIB_NG
+        return true;
+#else
+        return false;
+#endif
+    case DeflateBackend::Libdeflate:
+#ifdef SAINTS_HAVE_LIBDEFLATE
+        return true;
+#else
+        return false;
+#endif
+    }
+    return false;
+}
+
+DeflateBackend getDeflateBackend()
+{
+    return static_cast<DeflateBackend>(g_deflate_backend.loadAcquire());
+}
+
+void setDeflateBackend(DeflateBackend backend)
+{
+    if (!isDeflateBackendAvailable(backend)) {
+        throw std::runtime_error("Deflate backend is not available");
+    }
+    g_deflate_backend.storeRelease(static_cast<int>(backend));
+}
+
+DecompressionStats getDecompressionStats()
+{
+    DecompressionStats stats;
+    stats.contexts_created = g_contexts_created.loadAcquire();
+    stats.contexts_reused = g_contexts_reused.loadAcquire();
+    return stats;
+}
+
+void resetDecompressionStats()
+{
+    g_contexts_created.storeRelease(0);
+    g_contexts_reused.storeRelease(0);
+}
+
+void countDecompressionContext(bool reused)
+{
+    if (reused) {
+        g_contexts_reused.fetchAndAddRelaxed(1);
+    } else {
+        g_contexts_created.fetchAndAddRelaxed(1);
+    }
+}
+
+}
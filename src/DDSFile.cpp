@@ -1,11 +1,13 @@
 #include <QtCore/QtGlobal>
 #include <QtCore/QIODevice>
 #include <QtCore/QString>
+#include <QtCore/QByteArray>
 
 #include "Saints/DDSFile.hpp"
 #include "Saints/Exceptions.hpp"
 #include "Saints/PegEntry.hpp"
 #include "ByteIO.hpp"
+#include "Layouts.hpp"
 #include "util.hpp"
 
 
@@ -84,32 +86,24 @@ TextureFormat detectPixelformat(const DDSPixelformat& ddspf)
 void DDSPixelformat::read(QIODevice& stream)
 {
     ByteReader reader(stream);
+    read(reader);
+}
 
-    quint32 size = reader.readU32();
-    if (size != DDS_PIXELFORMAT_SIZE) {
-        throw FieldError("size", QString::number(size));
-    }
-    flags = reader.readU32();
-    four_cc = reader.readU32();
-    rgb_bit_count = reader.readU32();
-    r_bitmask = reader.readU32();
-    g_bitmask = reader.readU32();
-    b_bitmask = reader.readU32();
-    a_bitmask = reader.readU32();
+void DDSPixelformat::read(ByteReader& reader)
+{
+    DDSLayout::Pixelformat::read(*this, reader);
 }
 
 void DDSPixelformat::write(QIODevice& stream) const
 {
     ByteWriter writer(stream);
+    write(writer);
+    writer.flush();
+}
 
-    writer.writeU32(DDS_PIXELFORMAT_SIZE);
-    writer.writeU32(flags);
-    writer.writeU32(four_cc);
-    writer.writeU32(rgb_bit_count);
-    writer.writeU32(r_bitmask);
-    writer.writeU32(g_bitmask);
-    writer.writeU32(b_bitmask);
-    writer.writeU32(a_bitmask);
+void DDSPixelformat::write(ByteWriter& writer) const
+{
+    DDSLayout::Pixelformat::write(*this, writer);
 }
 
 
@@ -133,31 +127,15 @@ DDSFile::DDSFile()
 
 void DDSFile::open(QIODevice& stream)
 {
-    ByteReader reader(stream);
+    // Descriptor and header are parsed from memory
+    QByteArray header(stream.read(4 + DDS_HEADER_SIZE));
+    ByteReader reader(header);
 
     quint32 descriptor = reader.readU32();
     if (descriptor != FOURCC_DDS) {
         throw FieldError("descriptor", QString::number(descriptor, 16));
     }
-    quint32 size = reader.readU32();
-    if (size != DDS_HEADER_SIZE) {
-        throw FieldError("size", QString::number(size));
-    }
-    flags = reader.readU32();
-    height = reader.readU32();
-    width = reader.readU32();
-    pitch_or_linear_size = reader.readU32();
-    depth = reader.readU32();
-    mipmap_count = reader.readU32();
-    for (int i = 0; i < ARRAYSIZE(reserved1); i++) {
-        reserved1[i] = reader.readU32();
-    }
-    ddspf.read(stream);
-    caps = reader.readU32();
-    caps2 = reader.readU32();
-    caps3 = reader.readU32();
-    caps4 = reader.readU32();
-    reserved2 = reader.readU32();
+    DDSLayout::Header::read(*this, reader);
 
     data = stream.readAll();
 }
@@ -167,24 +145,10 @@ void DDSFile::write(QIODevice& stream) const
     ByteWriter writer(stream);
 
     writer.writeU32(FOURCC_DDS);
-    writer.writeU32(DDS_HEADER_SIZE);
-    writer.writeU32(flags);
-    writer.writeU32(height);
-    writer.writeU32(width);
-    writer.writeU32(pitch_or_linear_size);
-    writer.writeU32(depth);
-    writer.writeU32(mipmap_count);
-    for (int i = 0; i < ARRAYSIZE(reserved1); i++) {
-        writer.writeU32(reserved1[i]);
-    }
-    ddspf.write(stream);
-    writer.writeU32(caps);
-    writer.writeU32(caps2);
-    writer.writeU32(caps3);
-    writer.writeU32(caps4);
-    writer.writeU32(reserved2);
+    DDSLayout::Header::write(*this, writer);
 
     writer.write(data);
+    writer.flush();
 }
 
 }
@@ -0,0 +1,144 @@
+#pragma once
+#include <QtCore/QtGlobal>
+
+#include "Saints/PackfileEntry.hpp"
+#include "Saints/PegEntry.hpp"
+#include "Saints/DDSFile.hpp"
+#include "Saints/Colors.hpp"
+#include "RecordLayout.hpp"
+
+
+
+namespace Saints {
+
+// Directory records without the name offsets, those are parsed by the Packfile
+struct PackfileEntryLayout
+{
+    typedef PackfileEntry E;
+
+    typedef Layout<E,
+        Field<E, quint32, qint64, &E::m_start>,
+        Field<E, quint32, qint64, &E::m_size>,
+        Field<E, quint32, qint64, &E::m_compressed_size>,
+        Padding<4> // Parent pointer
+    > V6;
+
+    typedef Layout<E,
+        Field<E, quint32, qint64, &E::m_start>,
+        Field<E, quint32, qint64, &E::m_size>,
+        Field<E, quint32, qint64, &E::m_compressed_size>,
+        Field<E, quint16, int, &E::m_flags>,
+        Field<E, quint16, int, &E::m_alignment>
+    > V10;
+
+    typedef Layout<E,
+        Field<E, quint64, qint64, &E::m_start>,
+        Field<E, quint64, qint64, &E::m_size>,
+        Field<E, quint64, qint64, &E::m_compressed_size>,
+        Field<E, quint16, int, &E::m_flags>,
+        Field<E, quint32, int, &E::m_alignment>,
+        Padding<2>
+    > V17;
+};
+
+struct PegEntryLayout
+{
+    typedef PegEntry E;
+    typedef HDRColor C;
+
+    typedef Layout<C,
+        Field<C, float, float, &C::r>,
+        Field<C, float, float, &C::g>,
+        Field<C, float, float, &C::b>,
+        Field<C, float, float, &C::a>
+    > Color;
+
+    // Written from the data instead of the members
+    typedef Field<E, qint64, qint64, &E::offset> Offset;
+    typedef Field<E, quint32, qint64, &E::data_size> DataSize;
+
+    typedef Layout<E,
+        Offset,
+        Field<E, quint16, int, &E::width>,
+        Field<E, quint16, int, &E::height>,
+        Field<E, quint16, TextureFormat, &E::bm_fmt>,
+        Field<E, quint16, int, &E::pal_fmt>,
+        Field<E, quint16, int, &E::anim_tiles_width>,
+        Field<E, quint16, int, &E::anim_tiles_height>,
+        Field<E, quint16, int, &E::num_frames>,
+        Field<E, quint16, int, &E::flags>,
+        Padding<8>, // Runtime variable
+        Field<E, quint16, int, &E::pal_size>,
+        Field<E, quint8, int, &E::fps>,
+        Field<E, quint8, int, &E::mip_levels>,
+        DataSize,
+        Padding<32> // Runtime variables and padding
+    > V13;
+
+    typedef Layout<E,
+        Offset,
+        Field<E, quint16, int, &E::width>,
+        Field<E, quint16, int, &E::height>,
+        Field<E, quint16, TextureFormat, &E::bm_fmt>,
+        Field<E, quint16, int, &E::pal_fmt>,
+        Field<E, quint16, int, &E::anim_tiles_width>,
+        Field<E, quint16, int, &E::anim_tiles_height>,
+        Field<E, quint16, int, &E::depth>,
+        Field<E, quint16, int, &E::flags>,
+        NestedField<E, HDRColor, &E::avg_color, Color>,
+        Padding<8>, // Runtime variable (filename)
+        Field<E, quint16, int, &E::pal_size>,
+        Field<E, quint8, int, &E::fps>,
+        Field<E, quint8, int, &E::mip_levels>,
+        DataSize,
+        Padding<32>, // Runtime variables
+        Field<E, quint32, int, &E::num_mips_split>,
+        Field<E, quint32, quint32, &E::data_max_size>,
+        Padding<8>
+    > V19;
+};
+
+struct DDSLayout
+{
+    typedef DDSPixelformat P;
+    typedef DDSFile D;
+
+    typedef Layout<P,
+        SizeField<quint32, DDS_PIXELFORMAT_SIZE>,
+        Field<P, quint32, quint32, &P::flags>,
+        Field<P, quint32, quint32, &P::four_cc>,
+        Field<P, quint32, quint32, &P::rgb_bit_count>,
+        Field<P, quint32, quint32, &P::r_bitmask>,
+        Field<P, quint32, quint32, &P::g_bitmask>,
+        Field<P, quint32, quint32, &P::b_bitmask>,
+        Field<P, quint32, quint32, &P::a_bitmask>
+    > Pixelformat;
+
+    // Follows the descriptor
+    typedef Layout<D,
+        SizeField<quint32, DDS_HEADER_SIZE>,
+        Field<D, quint32, quint32, &D::flags>,
+        Field<D, quint32, quint32, &D::height>,
+        Field<D, quint32, quint32, &D::width>,
+        Field<D, quint32, quint32, &D::pitch_or_linear_size>,
+        Field<D, quint32, quint32, &D::depth>,
+        Field<D, quint32, quint32, &D::mipmap_count>,
+        ArrayField<D, quint32, 11, &D::reserved1>,
+        NestedField<D, DDSPixelformat, &D::ddspf, Pixelformat>,
+        Field<D, quint32, quint32, &D::caps>,
+        Field<D, quint32, quint32, &D::caps2>,
+        Field<D, quint32, quint32, &D::caps3>,
+        Field<D, quint32, quint32, &D::caps4>,
+        Field<D, quint32, quint32, &D::reserved2>
+    > Header;
+};
+
+static_assert(PackfileEntryLayout::V6::SIZE == PACKFILE_ENTRY_SIZE_6 - 4, "v6 record size");
+static_assert(PackfileEntryLayout::V10::SIZE == PACKFILE_ENTRY_SIZE_10 - 8, "v10 record size");
+static_assert(PackfileEntryLayout::V17::SIZE == PACKFILE_ENTRY_SIZE_17 - 16, "v17 record size");
+static_assert(PegEntryLayout::V13::SIZE == PEGENTRY_BINSIZE, "v13 entry size");
+static_assert(PegEntryLayout::V19::SIZE == PEGENTRY_BINSIZE_19, "v19 entry size");
+static_assert(DDSLayout::Pixelformat::SIZE == DDS_PIXELFORMAT_SIZE, "Pixelformat size");
+static_assert(DDSLayout::Header::SIZE == DDS_HEADER_SIZE, "DDS header size");
+
+}
@@ -1,10 +1,18 @@
 #include <cassert>
+#include <cstring>
+#include <limits>
+#include <algorithm>
 #include <QtCore/QtGlobal>
 #include <QtCore/QByteArray>
 #include <QtCore/QString>
 #include <QtCore/QIODevice>
 #include <QtCore/QVector>
+#include <QtCore/QHash>
 #include <QtCore/QBuffer>
+#include <QtCore/QFile>
+#include <QtCore/QFileDevice>
+#include <QtCore/QMutex>
+#include <QtCore/QMutexLocker>
 
 #include "Saints/Packfile.hpp"
 #include "Saints/PackfileEntry.hpp"
@@ -12,62 +20,211 @@
 #include "ByteIO.hpp"
 #include "util.hpp"
 
+#ifdef Q_OS_UNIX
+#include <errno.h>
+#include <unistd.h>
+#endif
+
 
 
 namespace Saints {
 
-constexpr quint32 PACKFILE_DESCRIPTOR = 0x51890ACE;
+// Compressed plus uncompressed bytes held at once by batch extraction
+constexpr qint64 EXTRACT_BATCH_SIZE = 64 * 1024 * 1024;
+// Input bytes read at once when streaming entries
+constexpr qint64 EXTRACT_CHUNK_SIZE = 1024 * 1024;
+// Sidecar files with checkpoints of condensed data
+constexpr quint32 CONDENSED_INDEX_SIGNATURE = makeFourCC("SCIX");
+constexpr quint32 CONDENSED_INDEX_VERSION = 1;
+// Cache key of the decompressed data of condensed archives, entries are >= 0
+constexpr int CONDENSED_DATA_KEY = -2;
 
-constexpr qint64 PACKFILE_HEADER_SIZE_6 = 380;
-constexpr qint64 PACKFILE_HEADER_SIZE_10 = 40;
-constexpr qint64 PACKFILE_HEADER_SIZE_17 = 120;
+static void writeChunk(QIODevice& sink, const char* data, qint64 size)
+{
+    if (sink.write(data, size) != size) {
+        throw IOError(QString("Failed to write %1 bytes").arg(size));
+    }
+}
 
 
 
 Packfile::Packfile() :
-    m_stream(nullptr)
+    m_stream(nullptr),
+    m_file_handle(-1),
+    m_map(nullptr),
+    m_map_size(0),
+    m_lazy(false),
+    m_big_endian(false),
+    m_names_loaded(false),
+    m_directory_loaded(0),
+    m_index_stale(0),
+    m_own_cache(new PackfileCache()),
+    m_cache(m_own_cache.get()),
+    m_partial_condensed(false),
+    m_partial_condensed_missed(false)
 {
 
 }
 
-Packfile::Packfile(QIODevice& stream) :
-    m_stream(&stream)
+Packfile::Packfile(QIODevice& stream, bool lazy) :
+    m_stream(&stream),
+    m_file_handle(-1),
+    m_map(nullptr),
+    m_map_size(0),
+    m_lazy(lazy),
+    m_big_endian(false),
+    m_names_loaded(false),
+    m_directory_loaded(0),
+    m_index_stale(0),
+    m_own_cache(new PackfileCache()),
+    m_cache(m_own_cache.get()),
+    m_partial_condensed(false),
+    m_partial_condensed_missed(false)
 {
-    load();
+    open(stream, lazy);
 }
 
-void Packfile::open(QIODevice& stream)
+Packfile::~Packfile()
 {
+    m_cache->releasePackfile(this);
+}
+
+void Packfile::open(QIODevice& stream, bool lazy)
+{
+    m_lazy = lazy;
+    m_map_buffer.reset();
+    m_map_file.reset();
+    m_map = nullptr;
+    m_map_size = 0;
+
     m_stream = &stream;
+    QFileDevice* file = qobject_cast<QFileDevice*>(&stream);
+    m_file_handle = file ? file->handle() : -1;
     load();
 }
 
+void Packfile::openMapped(const QString& path, bool lazy)
+{
+    m_lazy = lazy;
+    m_stream = nullptr;
+    m_file_handle = -1;
+    m_map = nullptr;
+    m_map_size = 0;
+    m_map_buffer.reset();
+    m_map_file.reset(new QFile(path));
+    if (!m_map_file->open(QIODevice::ReadOnly)) {
+        throw IOError(QString("Failed to open %1").arg(path));
+    }
+
+    m_map_size = m_map_file->size();
+    uchar* map = m_map_file->map(0, m_map_size);
+    if (map == nullptr) {
+        throw IOError(QString("Failed to map %1").arg(path));
+    }
+    m_map = reinterpret_cast<const char*>(map);
+
+    // The header, directory and names are at the start of the file, so the
+    // parser stream only needs to cover as much as a QByteArray can hold
+    qint64 header_size = qMin<qint64>(
+        m_map_size, std::numeric_limits<int>::max());
+    m_map_header = QByteArray::fromRawData(m_map, header_size);
+    m_map_buffer.reset(new QBuffer(&m_map_header));
+    m_map_buffer->open(QIODevice::ReadOnly);
+    m_stream = m_map_buffer.get();
+
+    load();
+}
+
+bool Packfile::isMapped() const
+{
+    return m_map != nullptr;
+}
+
+bool Packfile::isLazy() const
+{
+    return m_lazy;
+}
+
+bool Packfile::isBigEndian() const
+{
+    return m_big_endian;
+}
+
 void Packfile::load()
 {
     assert(m_stream);
-    ByteReader reader(*m_stream);
 
-    quint32 descriptor = reader.readU32();
+    m_cache->releasePackfile(this);
+    m_entries.clear();
+    m_entries_loaded.clear();
+    m_names.clear();
+    m_names_loaded = false;
+    m_directory_loaded.storeRelease(0);
+    m_filename_index.clear();
+    m_filepath_index.clear();
+    m_index_stale.storeRelease(0);
+    m_condensed_index.reset();
+    m_partial_condensed_missed = false;
 
-    if (descriptor != PACKFILE_DESCRIPTOR) {
+    QByteArray prefix(readRegion(0, 8));
+    ByteReader prefix_reader(prefix);
+    quint32 descriptor = prefix_reader.readU32();
+
+    m_big_endian = descriptor == swapBytes(PACKFILE_DESCRIPTOR);
+    if (descriptor != PACKFILE_DESCRIPTOR && !m_big_endian) {
         throw FieldError("descriptor", QString::number(descriptor, 16));
     }
 
-    m_version = reader.readU32();
+    prefix_reader.setBigEndian(m_big_endian);
+    m_version = prefix_reader.readU32();
+
+    qint64 header_size;
+    switch (m_version) {
+        case 6: header_size = PACKFILE_HEADER_SIZE_6; break;
+        case 10: header_size = PACKFILE_HEADER_SIZE_10; break;
+        case 17: header_size = PACKFILE_HEADER_SIZE_17; break;
+        default: throw ParsingError("Unsupported version");
+    }
+
+    // The whole header is parsed from memory
+    QByteArray header(readRegion(0, header_size));
+    ByteReader reader(header);
+    reader.setBigEndian(m_big_endian);
+    reader.seek(prefix.size());
 
+    int num_files;
     switch (m_version) {
-        case 6: loadHeader6(); break;
-        case 10: loadHeader10(); break;
-        case 17: loadHeader17(); break;
+        case 6: num_files = loadHeader6(reader); break;
+        case 10: num_files = loadHeader10(reader); break;
+        case 17: num_files = loadHeader17(reader); break;
         default: throw ParsingError("Unsupported version");
     }
+
+    // Checked before allocating, the count comes straight from the header
+    qint64 dir_size = static_cast<qint64>(num_files) * getEntrySize();
+    if (num_files < 0 || dir_size > m_dir_size) {
+        throw FieldError("num_files", QString::number(num_files));
+    }
+    qint64 file_size = m_map ? m_map_size : (m_stream->isSequential() ? -1 : m_stream->size());
+    if (file_size >= 0 && getEntriesOffset() + dir_size > file_size) {
+        throw ParsingError("Directory is outside of the file");
+    }
+
+    // Records are decoded in place. The vector moves its entries when it
+    // detaches from a copy, so they are identified by index, not by address.
+    m_entries = QVector<PackfileEntry>(num_files, PackfileEntry(*this));
+    for (int i = 0; i < num_files; i++) {
+        m_entries[i].m_index = i;
+    }
+    m_entries_loaded = QVector<bool>(num_files, false);
+
+    if (!m_lazy) {
+        loadDirectory();
+    }
 }
 
-void Packfile::loadHeader6()
+int Packfile::loadHeader6(ByteReader& reader)
 {
-    assert(m_stream);
-    ByteReader reader(*m_stream);
-
     reader.ignore(0x144); // Skip runtime variables
     m_flags = reader.readU32();
     reader.ignore(4); // Ignore sector value
@@ -83,28 +240,11 @@ void Packfile::loadHeader6()
     m_data_offset = 0;
     m_timestamp = 0;
 
-    reader.seek(getEntriesOffset());
-
-    QVector<qint64> filename_offsets;
-    for (int i = 0; i < num_files; i++) {
-        PackfileEntry entry(*this);
-        filename_offsets.push_back(reader.readU32());
-        entry.load6(*m_stream);
-        m_entries.push_back(entry);
-    }
-
-    qint64 entryname_offset = getEntryNamesOffset();
-    for (int i = 0; i < num_files; i++) {
-        reader.seek(entryname_offset + filename_offsets[i]);
-        m_entries[i].m_filename = reader.readCString();
-    }
+    return num_files;
 }
 
-void Packfile::loadHeader10()
+int Packfile::loadHeader10(ByteReader& reader)
 {
-    assert(m_stream);
-    ByteReader reader(*m_stream);
-
     m_header_checksum = reader.readU32();
     m_file_size = reader.readU32();
 
@@ -119,31 +259,16 @@ void Packfile::loadHeader10()
     m_data_offset = 0;
     m_timestamp = 0;
 
-    QVector<qint64> filename_offsets;
-    for (int i = 0; i < num_files; i++) {
-        PackfileEntry entry(*this);
-        filename_offsets.push_back(reader.readU64());
-        entry.load10(*m_stream);
-        m_entries.push_back(entry);
-    }
-
-    qint64 entryname_offset = getEntryNamesOffset();
-    for (int i = 0; i < num_files; i++) {
-        reader.seek(entryname_offset + filename_offsets[i]);
-        m_entries[i].m_filename = reader.readCString();
-    }
+    return num_files;
 }
 
-void Packfile::loadHeader17()
+int Packfile::loadHeader17(ByteReader& reader)
 {
-    assert(m_stream);
-    ByteReader reader(*m_stream);
-
     m_header_checksum = reader.readU32();
 
     m_flags = reader.readU32();
     int num_files = reader.readU32();
-    int num_paths = reader.readU32();
+    reader.ignore(4); // Number of directories
     m_dir_size = reader.readU32();
     m_filename_size = reader.readU32();
     m_file_size = reader.readU64();
@@ -154,93 +279,833 @@ void Packfile::loadHeader17()
     m_timestamp = reader.readU64();
     m_data_offset = reader.readU64();
 
-    reader.seek(getEntriesOffset());
+    return num_files;
+}
 
-    QVector<qint64> filename_offsets;
-    QVector<qint64> filepath_offsets;
-    for (int i = 0; i < num_files; i++) {
-        PackfileEntry entry(*this);
-        filename_offsets.push_back(reader.readU64());
-        filepath_offsets.push_back(reader.readU64());
-        entry.load17(*m_stream);
-        m_entries.push_back(entry);
-    }
-
-    reader.seek(getEntryNamesOffset());
-
-    // Reads filenames into a buffer for faster seeking
-    // Currently not functional
-//    QByteArray filename_data(reader.read(m_filename_size));
-//    QBuffer filename_buffer(&filename_data);
-//    filename_buffer.open(QIODevice::ReadOnly);
-//    ByteReader filename_reader(filename_buffer);
-    qint64 names_offset = getEntryNamesOffset();
-    for (int i = 0; i < num_files; i++) {
-        reader.seek(names_offset + filename_offsets[i]);
-        m_entries[i].m_filename = reader.readCString();
-        reader.seek(names_offset + filepath_offsets[i]);
-        m_entries[i].m_filepath = reader.readCString();
+void Packfile::loadDirectory()
+{
+    if (m_directory_loaded.loadAcquire()) {
+        return;
+    }
+
+    QMutexLocker lock(&m_directory_mutex);
+    if (m_directory_loaded.loadAcquire()) {
+        return;
+    }
+
+    loadNames();
+    qint64 entry_size = getEntrySize();
+    QByteArray directory(readRegion(getEntriesOffset(), m_entries.size() * entry_size));
+    bool swapped = m_big_endian && m_version == 6;
+    if (swapped) {
+        // v6 records are all 32 bit words, the table is swapped in bulk
+        byteSwap32(directory.data(), directory.size() / 4);
+    }
+    ByteReader reader(directory);
+    reader.setBigEndian(m_big_endian && !swapped);
+    for (int i = 0; i < m_entries.size(); i++) {
+        if (!m_entries_loaded[i]) {
+            reader.seek(i * entry_size);
+            decodeEntry(i, reader);
+        }
+    }
+
+    // Every name is decoded now
+    m_names.clear();
+    buildIndex();
+    m_directory_loaded.storeRelease(1);
+}
+
+void Packfile::loadEntry(int index)
+{
+    if (m_directory_loaded.loadAcquire()) {
+        return;
+    }
+
+    QMutexLocker lock(&m_directory_mutex);
+    if (m_entries_loaded[index]) {
+        return;
+    }
+
+    loadNames();
+    qint64 entry_size = getEntrySize();
+    QByteArray record(readRegion(getEntriesOffset() + index * entry_size, entry_size));
+    ByteReader reader(record);
+    reader.setBigEndian(m_big_endian);
+    decodeEntry(index, reader);
+}
+
+void Packfile::loadNames()
+{
+    if (!m_names_loaded) {
+        m_names = readRegion(getEntryNamesOffset(), m_filename_size);
+        m_names_loaded = true;
+    }
+}
+
+void Packfile::decodeEntry(int index, ByteReader& reader)
+{
+    PackfileEntry& entry = m_entries[index];
+
+    switch (m_version) {
+    case 6:
+        entry.m_filename = decodeCString(m_names, reader.readU32());
+        entry.load6(reader);
+        if ((m_flags & Compressed) && !(m_flags & Condensed)) {
+            // v6 has no entry flags, all entries are compressed separately
+            entry.m_flags = PackfileEntry::Compressed;
+        }
+        break;
+    case 10:
+        entry.m_filename = decodeCString(m_names, reader.readU64());
+        entry.load10(reader);
+        break;
+    case 17:
+        entry.m_filename = decodeCString(m_names, reader.readU64());
+        entry.m_filepath = decodeCString(m_names, reader.readU64());
+        entry.load17(reader);
+        break;
+    }
+
+    m_entries_loaded[index] = true;
+}
+
+void Packfile::buildIndex()
+{
+    m_filename_index.clear();
+    m_filepath_index.clear();
+    m_filename_index.reserve(m_entries.size());
+
+    for (int i = 0; i < m_entries.size(); i++) {
+        const PackfileEntry& entry = m_entries[i];
+        // Keep the first entry on duplicates, like a front to back search
+        QString filename_key = indexKey(entry.m_filename);
+        if (!m_filename_index.contains(filename_key)) {
+            m_filename_index.insert(filename_key, i);
+        }
+        if (!entry.m_filepath.isEmpty()) {
+            QString filepath_key = indexKey(entry.getFilepath());
+            if (!m_filepath_index.contains(filepath_key)) {
+                m_filepath_index.insert(filepath_key, i);
+            }
+        }
     }
 }
 
-void Packfile::loadFileData(PackfileEntry& entry)
+void Packfile::updateIndex()
+{
+    loadDirectory();
+    if (!m_index_stale.loadAcquire()) {
+        return;
+    }
+
+    QMutexLocker lock(&m_directory_mutex);
+    if (m_index_stale.loadAcquire()) {
+        // Cleared first so a rename during the rebuild isn't lost
+        m_index_stale.storeRelease(0);
+        buildIndex();
+    }
+}
+
+void Packfile::invalidateIndex(const PackfileEntry& entry)
+{
+    // Copies of entries aren't part of the index
+    int index = entry.m_index;
+    if (index >= 0 && index < m_entries.size() && &m_entries.at(index) == &entry) {
+        m_index_stale.storeRelease(1);
+    }
+}
+
+QString Packfile::indexKey(const QString& name)
+{
+    return name.toLower();
+}
+
+PackfileData Packfile::loadFileData(PackfileEntry& entry)
 {
     assert(m_stream);
-    if (entry.m_is_cached) {
+
+    PackfileData data;
+    int index = entry.m_index;
+    if (index < 0) {
+        // Not part of the directory, there is no key to cache it under
+        return readEntryData(entry);
+    }
+    if (m_cache->lookup(this, index, data)) {
+        return data;
+    }
+
+    {
+        // Wait if another thread is already loading the entry
+        QMutexLocker lock(&m_loading_mutex);
+        while (m_loading.contains(index)) {
+            m_loading_done.wait(&m_loading_mutex);
+            if (m_cache->lookup(this, index, data)) {
+                return data;
+            }
+        }
+        m_loading.insert(index);
+    }
+
+    try {
+        data = readEntryData(entry);
+        m_cache->insert(this, index, data);
+    } catch (...) {
+        QMutexLocker lock(&m_loading_mutex);
+        m_loading.remove(index);
+        m_loading_done.wakeAll();
+        throw;
+    }
+
+    QMutexLocker lock(&m_loading_mutex);
+    m_loading.remove(index);
+    m_loading_done.wakeAll();
+    return data;
+}
+
+PackfileData Packfile::readEntryData(const PackfileEntry& entry)
+{
+    if ((m_flags & Compressed) && (m_flags & Condensed)) {
+        qint64 entry_end = entry.m_start + entry.m_size;
+        PackfileData cached;
+        m_cache->lookup(this, CONDENSED_DATA_KEY, cached);
+        QByteArray condensed_data(cached.getBuffer());
+        if (condensed_data.size() < entry_end) {
+            std::shared_ptr<const InflateIndex> index;
+            {
+                QMutexLocker lock(&m_condensed_mutex);
+                index = m_condensed_index;
+            }
+            if (index) {
+                QByteArray data;
+                data.resize(entry.m_size);
+                qint64 data_pos = 0;
+                qint64 in_pos = getDataOffset();
+                decompressRange(in_pos, in_pos + m_compressed_data_size,
+                    index->find(entry.m_start), entry.m_start, entry.m_size,
+                    [&](const char* chunk, qint64 size) {
+                        memcpy(data.data() + data_pos, chunk, size);
+                        data_pos += size;
+                    });
+                return data;
+            }
+
+            condensed_data = loadCondensedData(m_partial_condensed ? entry_end : -1);
+        }
+
+        if (entry_end > condensed_data.size()) {
+            throw ParsingError("Entry is outside of the condensed data");
+        }
+        // The slice keeps the buffer alive after it is replaced by a longer
+        // prefix or evicted
+        return PackfileData(condensed_data, entry.m_start, entry.m_size);
+    }
+
+    qint64 entry_offset = getDataOffset() + entry.m_start;
+    if (entry.m_flags & Compressed) {
+        return decompressRegion(entry_offset, entry.m_compressed_size, -1, entry.m_size);
+    } else {
+        return readRegion(entry_offset, entry.m_size);
+    }
+}
+
+QByteArray Packfile::loadCondensedData(qint64 limit)
+{
+    // One thread inflates, the others wait for it and find the data cached
+    QMutexLocker lock(&m_condensed_mutex);
+    PackfileData cached;
+    qint64 required = limit >= 0 ? qMin(limit, m_data_size) : m_data_size;
+    if (m_cache->lookup(this, CONDENSED_DATA_KEY, cached)) {
+        if (cached.size() >= required) {
+            return cached.getBuffer();
+        }
+        m_partial_condensed_missed = true;
+    }
+
+    // Inflating restarts at the beginning, growing the prefix entry by entry
+    // would take quadratic time when walking the archive. After the first
+    // prefix fell short the whole block is inflated instead.
+    if (m_partial_condensed_missed) {
+        limit = -1;
+    }
+    QByteArray data(decompressRegion(getDataOffset(), m_compressed_data_size, limit, m_data_size));
+    m_cache->insert(this, CONDENSED_DATA_KEY, data);
+    return data;
+}
+
+void Packfile::loadFileData(const QVector<PackfileEntry*>& entries, int num_threads)
+{
+    if ((m_flags & Compressed) && (m_flags & Condensed)) {
+        for (PackfileEntry* entry : entries) {
+            loadFileData(*entry);
+        }
         return;
     }
 
+    extract(entries, [this](PackfileEntry& entry, const PackfileData& data) {
+        if (entry.m_index >= 0) {
+            m_cache->insert(this, entry.m_index, data);
+        }
+    }, num_threads);
+}
+
+void Packfile::extract(const QVector<PackfileEntry*>& entries,
+    const EntrySink& sink, int num_threads)
+{
+    assert(m_stream);
+
+    QVector<PackfileEntry*> sorted(entries);
+    std::sort(sorted.begin(), sorted.end(),
+        [](const PackfileEntry* a, const PackfileEntry* b) {
+            return a->m_start < b->m_start;
+        });
+
     if ((m_flags & Compressed) && (m_flags & Condensed)) {
-        m_stream->seek(getDataOffset());
-        QByteArray decompress_cache(
-            decompressStream(*m_stream)
-        );
-        for (PackfileEntry& cond_entry : m_entries) {
-            if (cond_entry.m_is_cached) {
-                continue;
+        // A single stream, there is nothing to decompress in parallel
+        QByteArray condensed_data(loadCondensedData(-1));
+        for (PackfileEntry* entry : sorted) {
+            if (entry->m_start + entry->m_size > condensed_data.size()) {
+                throw ParsingError("Entry is outside of the condensed data");
+            }
+            sink(*entry, PackfileData(condensed_data, entry->m_start, entry->m_size));
+        }
+        return;
+    }
+
+    qint64 data_offset = getDataOffset();
+    int batch_start = 0;
+    while (batch_start < sorted.size()) {
+        int batch_end = batch_start;
+        qint64 batch_bytes = 0;
+        while (batch_end < sorted.size() &&
+            (batch_end == batch_start || batch_bytes < EXTRACT_BATCH_SIZE))
+        {
+            const PackfileEntry* entry = sorted[batch_end];
+            batch_bytes += entry->m_size;
+            if (entry->m_flags & Compressed) {
+                batch_bytes += entry->m_compressed_size;
+            }
+            batch_end++;
+        }
+
+        int batch_count = batch_end - batch_start;
+        QVector<PackfileData> batch_data(batch_count);
+        QVector<bool> batch_cached(batch_count, false);
+        for (int i = 0; i < batch_count; i++) {
+            PackfileEntry* entry = sorted[batch_start + i];
+            if (entry->m_index >= 0 && m_cache->lookup(this, entry->m_index, batch_data[i])) {
+                batch_cached[i] = true;
+            } else if (entry->m_flags & Compressed) {
+                batch_data[i] = readRegion(
+                    data_offset + entry->m_start, entry->m_compressed_size);
+            } else {
+                batch_data[i] = readRegion(
+                    data_offset + entry->m_start, entry->m_size);
             }
-            cond_entry.m_data_cache = decompress_cache.mid(
-                cond_entry.m_start, cond_entry.m_size);
-            cond_entry.m_is_cached = true;
         }
+
+        parallelFor(batch_count, num_threads, [&](int i) {
+            const PackfileEntry* entry = sorted[batch_start + i];
+            if (batch_cached[i] || !(entry->m_flags & Compressed)) {
+                return;
+            }
+            batch_data[i] = decompressBuffer(batch_data[i].getBuffer(), -1, entry->m_size);
+        });
+
+        for (int i = 0; i < batch_count; i++) {
+            sink(*sorted[batch_start + i], batch_data[i]);
+            batch_data[i] = PackfileData();
+        }
+
+        batch_start = batch_end;
+    }
+}
+
+void Packfile::extractTo(const PackfileEntry& entry, QIODevice& sink)
+{
+    assert(m_stream);
+
+    PackfileData cached;
+    if (entry.m_index >= 0 && m_cache->lookup(this, entry.m_index, cached)) {
+        writeChunk(sink, cached.constData(), cached.size());
+        return;
+    }
+
+    ChunkSink write = [&sink](const char* data, qint64 size) {
+        writeChunk(sink, data, size);
+    };
+
+    qint64 in_pos = getDataOffset();
+    if ((m_flags & Compressed) && (m_flags & Condensed)) {
+        PackfileData condensed_data;
+        if (m_cache->lookup(this, CONDENSED_DATA_KEY, condensed_data) &&
+            entry.m_start + entry.m_size <= condensed_data.size())
+        {
+            writeChunk(sink, condensed_data.constData() + entry.m_start, entry.m_size);
+            return;
+        }
+        std::shared_ptr<const InflateIndex> index;
+        {
+            QMutexLocker lock(&m_condensed_mutex);
+            index = m_condensed_index;
+        }
+
+        // Only the entry is written, inflating starts at the closest checkpoint
+        decompressRange(in_pos, in_pos + m_compressed_data_size,
+            index ? index->find(entry.m_start) : nullptr,
+            entry.m_start, entry.m_size, write);
+    } else if (entry.m_flags & Compressed) {
+        in_pos += entry.m_start;
+        decompressRange(in_pos, in_pos + entry.m_compressed_size, nullptr,
+            0, entry.m_size, write);
     } else {
+        in_pos += entry.m_start;
+        qint64 in_end = in_pos + entry.m_size;
+        while (in_pos < in_end) {
+            QByteArray chunk(readRegion(in_pos, qMin(EXTRACT_CHUNK_SIZE, in_end - in_pos)));
+            writeChunk(sink, chunk.constData(), chunk.size());
+            in_pos += chunk.size();
+        }
+    }
+}
 
-        qint64 entry_offset = getDataOffset() + entry.m_start;
-        m_stream->seek(entry_offset);
+void Packfile::decompressRange(qint64 in_pos, qint64 in_end, const InflateCheckpoint* point,
+    qint64 out_start, qint64 out_size, const ChunkSink& sink)
+{
+    qint64 out_pos = 0;
+    qint64 out_end = out_start + out_size;
+    if (point) {
+        in_pos += point->in_pos;
+        out_pos = point->out_pos;
+    }
+    if (out_size == 0) {
+        return;
+    }
+
+    WriteCallback write = [&](const char* data, qint64 size) {
+        qint64 begin = qMax(out_pos, out_start);
+        qint64 end = qMin(out_pos + size, out_end);
+        if (begin < end) {
+            sink(data + (begin - out_pos), end - begin);
+        }
+        out_pos += size;
+        return out_pos < out_end;
+    };
 
+    ReadCallback read = readRegionChunks(in_pos, in_end);
+    if (point) {
+        inflateFrom(*point, read, write);
+    } else {
+        switch (m_version) {
+            case 6:
+            case 10: decompressZLIB(read, write); break;
+            case 17: decompressLZ4(read, write); break;
+            default: throw ParsingError("Unsupported version");
+        }
+    }
+
+    if (out_pos < out_end) {
+        throw ParsingError("Compressed data ended before the entry");
+    }
+}
+
+Packfile::Verification Packfile::verify(int num_threads)
+{
+    assert(m_stream);
+    loadDirectory();
+
+    Verification result;
+    verifyLayout(result.errors);
+
+    EntryVerification empty;
+    empty.crc32 = 0;
+    empty.size = 0;
+    result.entries = QVector<EntryVerification>(m_entries.size(), empty);
+
+    if ((m_flags & Compressed) && (m_flags & Condensed)) {
+        verifyCondensed(result);
+    } else {
+        parallelFor(m_entries.size(), num_threads, [&](int i) {
+            verifyEntry(m_entries[i], result.entries[i]);
+        });
+    }
+    return result;
+}
+
+void Packfile::verifyLayout(QVector<QString>& errors)
+{
+    if (!m_map && m_stream->isSequential()) {
+        errors.push_back("File size can't be checked on sequential devices");
+    } else {
+        qint64 file_size = m_map ? m_map_size : m_stream->size();
+        if (file_size != m_file_size) {
+            errors.push_back(QString("File is %1 bytes instead of %2")
+                .arg(file_size).arg(m_file_size));
+        }
+    }
+
+    qint64 dir_size = m_entries.size() * getEntrySize();
+    if (m_dir_size < dir_size) {
+        errors.push_back(QString("Directory of %1 bytes can't hold %2 entries")
+            .arg(m_dir_size).arg(m_entries.size()));
+    }
+
+    qint64 names_end = getEntryNamesOffset() + m_filename_size;
+    qint64 data_offset = getDataOffset();
+    if (data_offset < names_end) {
+        errors.push_back(QString("Data at %1 overlaps the names ending at %2")
+            .arg(data_offset).arg(names_end));
+    }
+
+    if ((m_flags & Compressed) && (m_flags & Condensed)) {
+        if (data_offset + m_compressed_data_size > m_file_size) {
+            errors.push_back("Condensed data is outside of the file");
+        }
+        return;
+    }
+
+    for (int i = 0; i < m_entries.size(); i++) {
+        const PackfileEntry& entry = m_entries[i];
+        qint64 stored_size = (entry.m_flags & Compressed) ? entry.m_compressed_size : entry.m_size;
+        if (entry.m_start < 0 || stored_size < 0 ||
+            data_offset + entry.m_start + stored_size > m_file_size)
+        {
+            errors.push_back(QString("Entry %1 is outside of the file").arg(i));
+        }
+    }
+}
+
+void Packfile::verifyEntry(const PackfileEntry& entry, EntryVerification& result)
+{
+    ChunkSink hash = [&result](const char* data, qint64 size) {
+        result.crc32 = updateCRC32(result.crc32, data, size);
+        result.size += size;
+    };
+
+    try {
+        qint64 in_pos = getDataOffset() + entry.m_start;
         if (entry.m_flags & Compressed) {
-            entry.m_data_cache = decompressStream(*m_stream);
+            decompressAll(in_pos, in_pos + entry.m_compressed_size, hash);
         } else {
-            entry.m_data_cache = m_stream->read(entry.m_size);
+            qint64 in_end = in_pos + entry.m_size;
+            while (in_pos < in_end) {
+                QByteArray chunk(readRegion(in_pos, qMin(EXTRACT_CHUNK_SIZE, in_end - in_pos)));
+                hash(chunk.constData(), chunk.size());
+                in_pos += chunk.size();
+            }
         }
+    } catch (const std::exception& e) {
+        result.error = QString::fromUtf8(e.what());
+        return;
+    }
 
-        entry.m_is_cached = true;
+    if (result.size != entry.m_size) {
+        result.error = QString("Decompressed to %1 bytes instead of %2")
+            .arg(result.size).arg(entry.m_size);
     }
 }
 
-PackfileEntry* Packfile::getEntryByFilename(const QString& filename)
+void Packfile::verifyCondensed(Verification& result)
 {
-    for (PackfileEntry& entry : m_entries) {
-        if (entry.m_filename == filename) {
-            return &entry;
+    // A single stream, entries are hashed as the data passes by
+    QVector<int> order(m_entries.size());
+    for (int i = 0; i < order.size(); i++) {
+        order[i] = i;
+    }
+    std::sort(order.begin(), order.end(), [this](int a, int b) {
+        return m_entries[a].m_start < m_entries[b].m_start;
+    });
+
+    qint64 out_pos = 0;
+    int first = 0;
+    ChunkSink hash = [&](const char* data, qint64 size) {
+        qint64 out_end = out_pos + size;
+        while (first < order.size() &&
+            m_entries[order[first]].m_start + m_entries[order[first]].m_size <= out_pos)
+        {
+            first++;
         }
+        for (int i = first; i < order.size(); i++) {
+            const PackfileEntry& entry = m_entries[order[i]];
+            if (entry.m_start >= out_end) {
+                break;
+            }
+            qint64 begin = qMax(out_pos, entry.m_start);
+            qint64 end = qMin(out_end, entry.m_start + entry.m_size);
+            if (begin < end) {
+                EntryVerification& entry_result = result.entries[order[i]];
+                entry_result.crc32 = updateCRC32(
+                    entry_result.crc32, data + (begin - out_pos), end - begin);
+                entry_result.size += end - begin;
+            }
+        }
+        out_pos = out_end;
+    };
+
+    try {
+        qint64 in_pos = getDataOffset();
+        decompressAll(in_pos, in_pos + m_compressed_data_size, hash);
+    } catch (const std::exception& e) {
+        result.errors.push_back(QString("Condensed data: %1").arg(e.what()));
     }
-    return nullptr;
+
+    if (out_pos != m_data_size) {
+        result.errors.push_back(QString("Condensed data is %1 bytes instead of %2")
+            .arg(out_pos).arg(m_data_size));
+    }
+    for (int i = 0; i < m_entries.size(); i++) {
+        if (result.entries[i].size != m_entries[i].m_size) {
+            result.entries[i].error = "Entry is outside of the condensed data";
+        }
+    }
+}
+
+void Packfile::decompressAll(qint64 in_pos, qint64 in_end, const ChunkSink& sink)
+{
+    ReadCallback read = readRegionChunks(in_pos, in_end);
+    WriteCallback write = [&sink](const char* data, qint64 size) {
+        sink(data, size);
+        return true;
+    };
+
+    qint64 consumed;
+    switch (m_version) {
+        case 6:
+        case 10: consumed = decompressZLIB(read, write); break;
+        case 17: consumed = decompressLZ4(read, write); break;
+        default: throw ParsingError("Unsupported version");
+    }
+
+    if (consumed == -1) {
+        throw ParsingError("Compressed data ended early");
+    }
+    if (consumed != in_end - in_pos) {
+        throw ParsingError(QString("Compressed stream is %1 bytes instead of %2")
+            .arg(consumed).arg(in_end - in_pos));
+    }
+}
+
+ReadCallback Packfile::readRegionChunks(qint64 offset, qint64 end)
+{
+    QByteArray chunk;
+    qint64 chunk_pos = 0;
+    return [this, offset, end, chunk, chunk_pos](char* data, qint64 size) mutable -> qint64 {
+        if (chunk_pos == chunk.size()) {
+            if (offset == end) {
+                return 0;
+            }
+            chunk = readRegion(offset, qMin(EXTRACT_CHUNK_SIZE, end - offset));
+            chunk_pos = 0;
+            offset += chunk.size();
+        }
+        qint64 len = qMin(size, chunk.size() - chunk_pos);
+        memcpy(data, chunk.constData() + chunk_pos, len);
+        chunk_pos += len;
+        return len;
+    };
+}
+
+void Packfile::buildCondensedIndex(qint64 interval)
+{
+    assert(m_stream);
+
+    if (!(m_flags & Compressed) || !(m_flags & Condensed) || m_version == 17) {
+        throw ParsingError("Only condensed zlib archives can be indexed");
+    }
+
+    qint64 in_pos = getDataOffset();
+    std::shared_ptr<const InflateIndex> index(new InflateIndex(buildInflateIndex(
+        readRegionChunks(in_pos, in_pos + m_compressed_data_size), interval)));
+
+    QMutexLocker lock(&m_condensed_mutex);
+    m_condensed_index = index;
+}
+
+void Packfile::saveCondensedIndex(QIODevice& stream) const
+{
+    std::shared_ptr<const InflateIndex> index;
+    {
+        QMutexLocker lock(&m_condensed_mutex);
+        index = m_condensed_index;
+    }
+    if (!index) {
+        throw ParsingError("No condensed index has been built");
+    }
+
+    ByteWriter writer(stream);
+    writer.writeU32(CONDENSED_INDEX_SIGNATURE);
+    writer.writeU32(CONDENSED_INDEX_VERSION);
+    writer.writeU64(m_compressed_data_size);
+    writer.writeU64(m_data_size);
+    writer.writeU64(index->interval);
+    writer.writeU32(index->points.size());
+    for (const InflateCheckpoint& point : index->points) {
+        writer.writeU64(point.out_pos);
+        writer.writeU64(point.in_pos);
+        writer.writeU8(point.bits);
+        writer.writeU8(point.prime);
+        QByteArray window(compressZLIB(point.window));
+        writer.writeU32(window.size());
+        writer.write(window);
+    }
+    writer.flush();
+}
+
+void Packfile::loadCondensedIndex(QIODevice& stream)
+{
+    if (!(m_flags & Compressed) || !(m_flags & Condensed) || m_version == 17) {
+        throw ParsingError("Only condensed zlib archives can be indexed");
+    }
+
+    ByteReader reader(stream);
+
+    quint32 signature = reader.readU32();
+    if (signature != CONDENSED_INDEX_SIGNATURE) {
+        throw FieldError("signature", QString::number(signature, 16));
+    }
+    quint32 version = reader.readU32();
+    if (version != CONDENSED_INDEX_VERSION) {
+        throw FieldError("version", QString::number(version));
+    }
+
+    qint64 compressed_data_size = reader.readU64();
+    qint64 data_size = reader.readU64();
+    if (compressed_data_size != m_compressed_data_size || data_size != m_data_size) {
+        throw ParsingError("Condensed index was built for a different archive");
+    }
+
+    std::shared_ptr<InflateIndex> index(new InflateIndex);
+    index->interval = reader.readU64();
+    int num_points = reader.readU32();
+    index->points.reserve(num_points);
+    qint64 last_out_pos = 0;
+    for (int i = 0; i < num_points; i++) {
+        InflateCheckpoint point;
+        point.out_pos = reader.readU64();
+        point.in_pos = reader.readU64();
+        point.bits = reader.readU8();
+        point.prime = reader.readU8();
+        QByteArray window(reader.read(reader.readU32()));
+        point.window = decompressZLIB(window, -1, INFLATE_WINDOW_SIZE);
+
+        if (point.bits > 7 || point.out_pos <= last_out_pos ||
+            point.out_pos > m_data_size || point.in_pos > m_compressed_data_size)
+        {
+            throw ParsingError(QString("Invalid condensed index checkpoint %1").arg(i));
+        }
+        last_out_pos = point.out_pos;
+        index->points.push_back(point);
+    }
+
+    QMutexLocker lock(&m_condensed_mutex);
+    m_condensed_index = index;
+}
+
+bool Packfile::hasCondensedIndex() const
+{
+    QMutexLocker lock(&m_condensed_mutex);
+    return !!m_condensed_index;
+}
+
+void Packfile::clearCondensedIndex()
+{
+    QMutexLocker lock(&m_condensed_mutex);
+    m_condensed_index.reset();
+}
+
+void Packfile::extractAll(const EntrySink& sink, int num_threads)
+{
+    loadDirectory();
+    QVector<PackfileEntry*> entries;
+    entries.reserve(m_entries.size());
+    for (PackfileEntry& entry : m_entries) {
+        entries.push_back(&entry);
+    }
+    extract(entries, sink, num_threads);
+}
+
+PackfileEntry* Packfile::getEntryByFilename(const QString& filename)
+{
+    const Packfile* const_this = this;
+    return const_cast<PackfileEntry*>(const_this->getEntryByFilename(filename));
 }
 
 const PackfileEntry* Packfile::getEntryByFilename(const QString& filename) const
 {
-    for (const PackfileEntry& entry : m_entries) {
-        if (entry.m_filename == filename) {
+    const_cast<Packfile*>(this)->updateIndex();
+    auto it = m_filename_index.constFind(indexKey(filename));
+    if (it == m_filename_index.constEnd()) {
+        return nullptr;
+    }
+    return &m_entries[it.value()];
+}
+
+PackfileEntry* Packfile::getEntryByFilepath(const QString& filepath)
+{
+    const Packfile* const_this = this;
+    return const_cast<PackfileEntry*>(const_this->getEntryByFilepath(filepath));
+}
+
+const PackfileEntry* Packfile::getEntryByFilepath(const QString& filepath) const
+{
+    const_cast<Packfile*>(this)->updateIndex();
+    QString key = indexKey(filepath);
+    auto it = m_filepath_index.constFind(key);
+    if (it != m_filepath_index.constEnd()) {
+        return &m_entries[it.value()];
+    }
+
+    // Entries without a directory are addressed by their filename alone
+    it = m_filename_index.constFind(key);
+    if (it != m_filename_index.constEnd()) {
+        const PackfileEntry& entry = m_entries[it.value()];
+        if (entry.m_filepath.isEmpty()) {
             return &entry;
         }
     }
     return nullptr;
 }
 
-qint64 Packfile::getEntriesOffset()
+Packfile::IndexStats Packfile::getIndexStats() const
+{
+    IndexStats stats;
+    stats.filename_keys = m_filename_index.size();
+    stats.filepath_keys = m_filepath_index.size();
+    stats.buckets = m_filename_index.capacity() + m_filepath_index.capacity();
+    return stats;
+}
+
+qint64 Packfile::getEntrySize()
 {
     switch (m_version) {
+        case 6: return PACKFILE_ENTRY_SIZE_6;
+        case 10: return PACKFILE_ENTRY_SIZE_10;
+        case 17: return PACKFILE_ENTRY_SIZE_17;
+        default: throw ParsingError("Unsupported version");
+    }
+}
+
+qint64 Packfile::getEntriesOffset()
+{
+    return calcEntriesOffset(m_version);
+}
+
+qint64 Packfile::getEntryNamesOffset()
+{
+    return calcEntryNamesOffset(m_version, m_dir_size);
+}
+
+qint64 Packfile::getDataOffset()
+{
+    if (m_version == 17) {
+        return m_data_offset;
+    }
+    return calcDataOffset(m_version, m_dir_size, m_filename_size);
+}
+
+qint64 Packfile::calcEntriesOffset(int version)
+{
+    switch (version) {
         case 6: return alignAddress(PACKFILE_HEADER_SIZE_6, 2048);
         case 10: return PACKFILE_HEADER_SIZE_10;
         case 17: return PACKFILE_HEADER_SIZE_17;
@@ -248,46 +1113,140 @@ qint64 Packfile::getEntriesOffset()
     }
 }
 
-qint64 Packfile::getEntryNamesOffset()
+qint64 Packfile::calcEntryNamesOffset(int version, qint64 dir_size)
 {
-    switch (m_version) {
-        case 6: return alignAddress(getEntriesOffset() + m_dir_size, 2048);
-        case 10: return getEntriesOffset() + m_dir_size;
-        case 17: return getEntriesOffset() + m_dir_size;
+    switch (version) {
+        case 6: return alignAddress(calcEntriesOffset(version) + dir_size, 2048);
+        case 10: return calcEntriesOffset(version) + dir_size;
+        case 17: return calcEntriesOffset(version) + dir_size;
         default: throw ParsingError("Unsupported version");
     }
 }
 
-qint64 Packfile::getDataOffset()
+qint64 Packfile::calcDataOffset(int version, qint64 dir_size, qint64 filename_size)
 {
-    switch (m_version) {
-        case 6: return alignAddress(getEntryNamesOffset() + m_filename_size, 2048);
-        case 10: return getEntryNamesOffset() + m_filename_size;
-        case 17: return m_data_offset;
+    qint64 names_end = calcEntryNamesOffset(version, dir_size) + filename_size;
+    switch (version) {
+        case 6: return alignAddress(names_end, 2048);
+        case 10: return names_end;
+        // Stored in the header, the data can't start before the names end
+        case 17: return names_end;
         default: throw ParsingError("Unsupported version");
     }
 }
 
-QByteArray Packfile::decompressStream(QIODevice& stream)
+QByteArray Packfile::decompressBuffer(const QByteArray& compressed, qint64 limit,
+    qint64 out_size, int num_threads)
 {
     switch (m_version) {
         case 6:
-        case 10: return decompressZLIB(stream);
-        case 17: return decompressLZ4(stream);
+        case 10: return decompressZLIB(compressed, limit, out_size);
+        case 17: return decompressLZ4(compressed, limit, out_size, num_threads);
         default: throw ParsingError("Unsupported version");
     }
 }
 
-PackfileEntry& Packfile::getEntry(int index) {return m_entries[index];}
-const PackfileEntry& Packfile::getEntry(int index) const {return m_entries[index];}
-QVector<PackfileEntry>& Packfile::getEntries() {return m_entries;}
-const QVector<PackfileEntry>& Packfile::getEntries() const {return m_entries;}
+QByteArray Packfile::decompressRegion(qint64 offset, qint64 size, qint64 limit,
+    qint64 out_size)
+{
+    // One exact read, the codec gets the whole input at once. Large LZ4
+    // frames are decoded on all cores.
+    return decompressBuffer(readRegion(offset, size), limit, out_size, 0);
+}
+
+QByteArray Packfile::readRegion(qint64 offset, qint64 size)
+{
+    if (m_map) {
+        if (offset < 0 || size < 0 || offset + size > m_map_size) {
+            throw IOError(QString("Region %1+%2 is outside of the file")
+                .arg(offset).arg(size));
+        }
+        return QByteArray::fromRawData(m_map + offset, size);
+    }
+
+#ifdef Q_OS_UNIX
+    if (m_file_handle >= 0) {
+        QByteArray buffer(size, 0);
+        qint64 bytes_read = 0;
+        while (bytes_read < size) {
+            ssize_t ret = pread(m_file_handle, buffer.data() + bytes_read,
+                size - bytes_read, offset + bytes_read);
+            if (ret < 0 && errno == EINTR) {
+                continue;
+            }
+            if (ret < 0) {
+                throw IOError(QString("Error reading %1 bytes at %2")
+                    .arg(size).arg(offset));
+            }
+            if (ret == 0) {
+                throw IOError(QString("End of file while reading %1 bytes")
+                    .arg(size));
+            }
+            bytes_read += ret;
+        }
+        return buffer;
+    }
+#endif
+
+    QMutexLocker lock(&m_stream_mutex);
+    ByteReader reader(*m_stream);
+    reader.seek(offset);
+    return reader.read(size);
+}
+
+PackfileEntry& Packfile::getEntry(int index)
+{
+    loadEntry(index);
+    return m_entries[index];
+}
+
+const PackfileEntry& Packfile::getEntry(int index) const
+{
+    const_cast<Packfile*>(this)->loadEntry(index);
+    return m_entries[index];
+}
+
+QVector<PackfileEntry>& Packfile::getEntries()
+{
+    loadDirectory();
+    return m_entries;
+}
+
+const QVector<PackfileEntry>& Packfile::getEntries() const
+{
+    const_cast<Packfile*>(this)->loadDirectory();
+    return m_entries;
+}
+
 int Packfile::getEntriesCount() const {return m_entries.size();}
+PackfileCache* Packfile::getCache() const {return m_cache;}
+
+void Packfile::setCache(PackfileCache* cache)
+{
+    m_cache->releasePackfile(this);
+    m_cache = cache ? cache : m_own_cache.get();
+}
+
+bool Packfile::Verification::isValid() const
+{
+    if (!errors.isEmpty()) {
+        return false;
+    }
+    for (const EntryVerification& entry : entries) {
+        if (!entry.error.isEmpty()) {
+            return false;
+        }
+    }
+    return true;
+}
+
 int Packfile::getVersion() const {return m_version;}
 void Packfile::setVersion(int value) {m_version = value;}
 int Packfile::getFlags() const {return m_flags;}
 void Packfile::setFlags(int value) {m_flags = value;}
 qint64 Packfile::getTimestamp() const {return m_timestamp;}
 void Packfile::setTimestamp(qint64 value) {m_timestamp = value;}
+bool Packfile::getPartialCondensedLoading() const {return m_partial_condensed;}
+void Packfile::setPartialCondensedLoading(bool value) {m_partial_condensed = value;}
 
 }
@@ -0,0 +1,213 @@
+#include <QtCore/QtGlobal>
+#include <QtCore/QByteArray>
+#include <QtCore/QHash>
+#include <QtCore/QMutex>
+#include <QtCore/QMutexLocker>
+
+#include "Saints/PackfileCache.hpp"
+
+
+
+namespace Saints {
+
+PackfileCache::PackfileCache(qint64 budget) :
+    m_budget(budget),
+    m_size(0),
+    m_hits(0),
+    m_misses(0),
+    m_evictions(0)
+{
+
+}
+
+bool PackfileCache::lookup(const Packfile* packfile, int index, PackfileData& data)
+{
+    QMutexLocker lock(&m_mutex);
+
+    auto it = m_lookup.find(Key(packfile, index));
+    if (it == m_lookup.end()) {
+        m_misses++;
+        return false;
+    }
+
+    m_items.splice(m_items.begin(), m_items, it.value());
+    data = it.value()->data;
+    m_hits++;
+    return true;
+}
+
+bool PackfileCache::contains(const Packfile* packfile, int index) const
+{
+    QMutexLocker lock(&m_mutex);
+    return m_lookup.contains(Key(packfile, index));
+}
+
+void PackfileCache::insert(const Packfile* packfile, int index, const PackfileData& data)
+{
+    QMutexLocker lock(&m_mutex);
+
+    Key key(packfile, index);
+    addBuffer(data);
+    auto it = m_lookup.find(key);
+    if (it != m_lookup.end()) {
+        ItemIterator item = it.value();
+        removeBuffer(item->data);
+        item->data = data;
+        m_items.splice(m_items.begin(), m_items, item);
+    } else {
+        m_items.push_front({key, data, 0});
+        m_lookup.insert(key, m_items.begin());
+    }
+
+    evict();
+}
+
+void PackfileCache::release(const Packfile* packfile, int index)
+{
+    QMutexLocker lock(&m_mutex);
+
+    auto it = m_lookup.find(Key(packfile, index));
+    if (it != m_lookup.end()) {
+        removeItem(it.value());
+    }
+}
+
+void PackfileCache::releasePackfile(const Packfile* packfile)
+{
+    QMutexLocker lock(&m_mutex);
+
+    auto it = m_items.begin();
+    while (it != m_items.end()) {
+        ItemIterator next = std::next(it);
+        if (it->key.first == packfile) {
+            removeItem(it);
+        }
+        it = next;
+    }
+}
+
+void PackfileCache::clear()
+{
+    QMutexLocker lock(&m_mutex);
+
+    m_items.clear();
+    m_lookup.clear();
+    m_buffers.clear();
+    m_size = 0;
+}
+
+bool PackfileCache::pin(const Packfile* packfile, int index)
+{
+    QMutexLocker lock(&m_mutex);
+
+    auto it = m_lookup.find(Key(packfile, index));
+    if (it == m_lookup.end()) {
+        return false;
+    }
+    it.value()->pins++;
+    return true;
+}
+
+void PackfileCache::unpin(const Packfile* packfile, int index)
+{
+    QMutexLocker lock(&m_mutex);
+
+    auto it = m_lookup.find(Key(packfile, index));
+    if (it != m_lookup.end() && it.value()->pins > 0) {
+        it.value()->pins--;
+        evict();
+    }
+}
+
+qint64 PackfileCache::getBudget() const
+{
+    QMutexLocker lock(&m_mutex);
+    return m_budget;
+}
+
+void PackfileCache::setBudget(qint64 value)
+{
+    QMutexLocker lock(&m_mutex);
+    m_budget = value;
+    evict();
+}
+
+PackfileCache::Stats PackfileCache::getStats() const
+{
+    QMutexLocker lock(&m_mutex);
+
+    Stats stats;
+    stats.hits = m_hits;
+    stats.misses = m_misses;
+    stats.evictions = m_evictions;
+    stats.size = m_size;
+    stats.budget = m_budget;
+    stats.items = m_lookup.size();
+    stats.pinned_items = 0;
+    for (const Item& item : m_items) {
+        if (item.pins > 0) {
+            stats.pinned_items++;
+        }
+    }
+    return stats;
+}
+
+void PackfileCache::resetStats()
+{
+    QMutexLocker lock(&m_mutex);
+
+    m_hits = 0;
+    m_misses = 0;
+    m_evictions = 0;
+}
+
+void PackfileCache::evict()
+{
+    if (m_budget < 0) {
+        return;
+    }
+
+    // The most recently used item stays, even if it exceeds the budget alone
+    auto it = m_items.end();
+    while (m_size > m_budget && it != m_items.begin()) {
+        --it;
+        if (it == m_items.begin()) {
+            break;
+        }
+        if (it->pins > 0) {
+            continue;
+        }
+        ItemIterator next = std::next(it);
+        removeItem(it);
+        m_evictions++;
+        it = next;
+    }
+}
+
+void PackfileCache::removeItem(ItemIterator it)
+{
+    removeBuffer(it->data);
+    m_lookup.remove(it->key);
+    m_items.erase(it);
+}
+
+void PackfileCache::addBuffer(const PackfileData& data)
+{
+    const QByteArray& buffer = data.getBuffer();
+    Buffer& entry = m_buffers[buffer.constData()];
+    if (entry.refs++ == 0) {
+        entry.size = buffer.size();
+        m_size += entry.size;
+    }
+}
+
+void PackfileCache::removeBuffer(const PackfileData& data)
+{
+    auto it = m_buffers.find(data.getBuffer().constData());
+    if (it != m_buffers.end() && --it.value().refs == 0) {
+        m_size -= it.value().size;
+        m_buffers.erase(it);
+    }
+}
+
+}
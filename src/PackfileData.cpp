@@ -0,0 +1,53 @@
+#include <cassert>
+#include <QtCore/QtGlobal>
+#include <QtCore/QByteArray>
+
+#include "Saints/PackfileData.hpp"
+
+
+
+namespace Saints {
+
+PackfileData::PackfileData() :
+    m_offset(0),
+    m_size(0)
+{
+
+}
+
+PackfileData::PackfileData(const QByteArray& data) :
+    m_buffer(data),
+    m_offset(0),
+    m_size(data.size())
+{
+
+}
+
+PackfileData::PackfileData(const QByteArray& buffer, qint64 offset, qint64 size) :
+    m_buffer(buffer),
+    m_offset(offset),
+    m_size(size)
+{
+    assert(offset >= 0 && size >= 0 && offset + size <= buffer.size());
+}
+
+QByteArray PackfileData::toByteArray() const
+{
+    if (m_offset == 0 && m_size == m_buffer.size()) {
+        return m_buffer;
+    }
+    return QByteArray(constData(), m_size);
+}
+
+PackfileData::operator QByteArray() const
+{
+    return toByteArray();
+}
+
+const char* PackfileData::constData() const {return m_buffer.constData() + m_offset;}
+qint64 PackfileData::size() const {return m_size;}
+bool PackfileData::isEmpty() const {return m_size == 0;}
+const QByteArray& PackfileData::getBuffer() const {return m_buffer;}
+qint64 PackfileData::getOffset() const {return m_offset;}
+
+}
@@ -5,8 +5,10 @@
 #include <QtCore/QFileInfo>
 
 #include "ByteIO.hpp"
+#include "Layouts.hpp"
 #include "Saints/Packfile.hpp"
 #include "Saints/PackfileEntry.hpp"
+#include "Saints/PackfileCache.hpp"
 
 
 
@@ -14,14 +16,14 @@ namespace Saints {
 
 PackfileEntry::PackfileEntry() :
     m_packfile(nullptr),
-    m_is_cached(false)
+    m_index(-1)
 {
 
 }
 
 PackfileEntry::PackfileEntry(Packfile& packfile) :
     m_packfile(&packfile),
-    m_is_cached(false)
+    m_index(-1)
 {
 
 }
@@ -29,45 +31,69 @@ PackfileEntry::PackfileEntry(Packfile& packfile) :
 void PackfileEntry::load6(QIODevice& stream)
 {
     ByteReader reader(stream);
-
-    m_start = reader.readU32();
-    m_size = reader.readU32();
-    m_compressed_size = reader.readU32();
-    m_flags = 0;
-    m_alignment = 0;
-    reader.ignore(4); // parent pointer, we have our own
+    load6(reader);
 }
 
 void PackfileEntry::load10(QIODevice& stream)
 {
     ByteReader reader(stream);
-
-    m_start = reader.readU32();
-    m_size = reader.readU32();
-    m_compressed_size = reader.readU32();
-    m_flags = reader.readU16();
-    m_alignment = reader.readU16();
+    load10(reader);
 }
 
 void PackfileEntry::load17(QIODevice& stream)
 {
     ByteReader reader(stream);
+    load17(reader);
+}
+
+void PackfileEntry::load6(ByteReader& reader)
+{
+    PackfileEntryLayout::V6::read(*this, reader);
+    m_flags = 0;
+    m_alignment = 0;
+}
 
-    m_start = reader.readU64();
-    m_size = reader.readU64();
-    m_compressed_size = reader.readU64();
-    m_flags = reader.readU16();
-    m_alignment = reader.readU32();
-    reader.ignore(2);
+void PackfileEntry::load10(ByteReader& reader)
+{
+    PackfileEntryLayout::V10::read(*this, reader);
 }
 
-QByteArray& PackfileEntry::getData()
+void PackfileEntry::load17(ByteReader& reader)
 {
-    if (!m_is_cached) {
-        m_packfile->loadFileData(*this);
+    PackfileEntryLayout::V17::read(*this, reader);
+}
+
+PackfileData PackfileEntry::getData()
+{
+    return m_packfile->loadFileData(*this);
+}
+
+bool PackfileEntry::isCached() const
+{
+    return m_packfile->getCache()->contains(m_packfile, m_index);
+}
+
+void PackfileEntry::release()
+{
+    m_packfile->getCache()->release(m_packfile, m_index);
+}
+
+void PackfileEntry::pin()
+{
+    // Entries outside of the directory aren't cached
+    if (m_index < 0) {
+        return;
     }
 
-    return m_data_cache;
+    // Another thread can evict the entry between loading and pinning
+    do {
+        m_packfile->loadFileData(*this);
+    } while (!m_packfile->getCache()->pin(m_packfile, m_index));
+}
+
+void PackfileEntry::unpin()
+{
+    m_packfile->getCache()->unpin(m_packfile, m_index);
 }
 
 QString PackfileEntry::getFilepath() const
@@ -88,14 +114,22 @@ void PackfileEntry::setFilepath(const QString& value)
     } else {
         m_filename = value;
     }
+    nameChanged();
+}
+
+void PackfileEntry::nameChanged()
+{
+    if (m_packfile) {
+        m_packfile->invalidateIndex(*this);
+    }
 }
 
 
 
 QString PackfileEntry::getFilename() const {return m_filename;}
-void PackfileEntry::setFilename(const QString& value) {m_filename = value;}
+void PackfileEntry::setFilename(const QString& value) {m_filename = value; nameChanged();}
 QString PackfileEntry::getDirectory() const {return m_filepath;}
-void PackfileEntry::setDirectory(const QString& value) {m_filepath = value;}
+void PackfileEntry::setDirectory(const QString& value) {m_filepath = value; nameChanged();}
 qint64 PackfileEntry::getStart() const {return m_start;}
 void PackfileEntry::setStart(qint64 value) {m_start = value;}
 qint64 PackfileEntry::getSize() const {return m_size;}
@@ -0,0 +1,291 @@
+#include <QtCore/QtGlobal>
+#include <QtCore/QByteArray>
+#include <QtCore/QString>
+#include <QtCore/QIODevice>
+#include <QtCore/QVector>
+#include <QtCore/QHash>
+
+#include "Saints/PackfileWriter.hpp"
+#include "Saints/Packfile.hpp"
+#include "Saints/PackfileEntry.hpp"
+#include "Saints/Exceptions.hpp"
+#include "ByteIO.hpp"
+#include "util.hpp"
+
+
+
+namespace Saints {
+
+// Uncompressed payload bytes compressed and written per batch
+constexpr qint64 WRITE_BATCH_SIZE = 64 * 1024 * 1024;
+// Stored as compressed size of data that is not compressed
+constexpr qint64 SIZE_NOT_COMPRESSED = -1;
+
+PackfileWriter::PackfileWriter() :
+    PackfileWriter(17, 0)
+{
+
+}
+
+PackfileWriter::PackfileWriter(int version, int flags) :
+    m_version(version),
+    m_flags(flags),
+    m_timestamp(0),
+    m_compression_level(-1),
+    m_num_threads(0),
+    m_big_endian(false)
+{
+
+}
+
+void PackfileWriter::addEntry(const QString& filepath, const QByteArray& data, int alignment)
+{
+    Item item;
+    int last_sep = filepath.lastIndexOf('\\');
+    if (last_sep >= 0) {
+        item.directory = filepath.left(last_sep);
+        item.filename = filepath.mid(last_sep + 1);
+    } else {
+        item.filename = filepath;
+    }
+    item.data = data;
+    item.alignment = qMax(1, alignment);
+    m_items.push_back(item);
+}
+
+void PackfileWriter::write(QIODevice& stream) const
+{
+    if (stream.isSequential()) {
+        throw IOError("Packfile output has to be seekable");
+    }
+
+    qint64 entry_size;
+    switch (m_version) {
+        case 6: entry_size = PACKFILE_ENTRY_SIZE_6; break;
+        case 10: entry_size = PACKFILE_ENTRY_SIZE_10; break;
+        case 17: entry_size = PACKFILE_ENTRY_SIZE_17; break;
+        default: throw ParsingError("Unsupported version");
+    }
+
+    bool compressed = m_flags & Packfile::Compressed;
+    bool condensed = compressed && (m_flags & Packfile::Condensed);
+    int num_files = m_items.size();
+
+    // Build the name table, identical strings are stored once
+    QByteArray names;
+    QHash<QString, qint64> name_offsets;
+    auto addName = [&](const QString& name) -> qint64 {
+        auto it = name_offsets.constFind(name);
+        if (it != name_offsets.constEnd()) {
+            return it.value();
+        }
+        qint64 offset = names.size();
+        names.append(name.toUtf8());
+        names.append('\0');
+        name_offsets.insert(name, offset);
+        return offset;
+    };
+
+    QVector<Record> records(num_files);
+    QHash<QString, int> directories;
+    for (int i = 0; i < num_files; i++) {
+        const Item& item = m_items[i];
+        Record& record = records[i];
+        record.filename_offset = addName(item.filename);
+        record.filepath_offset = 0;
+        if (m_version == 17) {
+            record.filepath_offset = addName(item.directory);
+            directories.insert(item.directory, 0);
+        }
+        record.size = item.data.size();
+        record.compressed_size = SIZE_NOT_COMPRESSED;
+        record.flags = 0;
+        record.alignment = item.alignment;
+    }
+
+    qint64 dir_size = num_files * entry_size;
+    qint64 entries_offset = Packfile::calcEntriesOffset(m_version);
+    qint64 names_offset = Packfile::calcEntryNamesOffset(m_version, dir_size);
+    if (m_version != 6) {
+        // Pad the names so the data starts aligned, v6 aligns it by itself
+        qint64 names_end = names_offset + names.size();
+        names.append(QByteArray(alignAddress(names_end, 16) - names_end, '\0'));
+    }
+    qint64 data_offset = Packfile::calcDataOffset(m_version, dir_size, names.size());
+
+    qint64 base = stream.pos();
+    ByteWriter writer(stream);
+    writer.setBigEndian(m_big_endian);
+
+    // Header and directory are filled in once the data offsets are known
+    writer.pad(names_offset);
+    writer.write(names);
+    writer.pad(data_offset - names_offset - names.size());
+
+    qint64 data_size = 0;
+    qint64 compressed_data_size = SIZE_NOT_COMPRESSED;
+    qint64 data_pos = 0;
+    if (condensed) {
+        QByteArray condensed_data;
+        for (int i = 0; i < num_files; i++) {
+            const Item& item = m_items[i];
+            qint64 start = alignAddress(condensed_data.size(), item.alignment);
+            condensed_data.append(QByteArray(start - condensed_data.size(), '\0'));
+            records[i].start = start;
+            condensed_data.append(item.data);
+        }
+
+        QByteArray compressed_data(compressData(condensed_data));
+        writer.write(compressed_data);
+        data_size = condensed_data.size();
+        compressed_data_size = compressed_data.size();
+        data_pos = compressed_data.size();
+    } else {
+        if (compressed) {
+            compressed_data_size = 0;
+        }
+
+        int batch_start = 0;
+        while (batch_start < num_files) {
+            int batch_end = batch_start;
+            qint64 batch_bytes = 0;
+            while (batch_end < num_files &&
+                (batch_end == batch_start || batch_bytes < WRITE_BATCH_SIZE))
+            {
+                batch_bytes += m_items[batch_end].data.size();
+                batch_end++;
+            }
+
+            int batch_count = batch_end - batch_start;
+            QVector<QByteArray> batch_data(batch_count);
+            parallelFor(batch_count, m_num_threads, [&](int i) {
+                const QByteArray& data = m_items[batch_start + i].data;
+                batch_data[i] = compressed ? compressData(data) : data;
+            });
+
+            for (int i = 0; i < batch_count; i++) {
+                const Item& item = m_items[batch_start + i];
+                Record& record = records[batch_start + i];
+                qint64 start = alignAddress(data_pos, item.alignment);
+                writer.pad(start - data_pos);
+                writer.write(batch_data[i]);
+
+                record.start = start;
+                if (compressed) {
+                    record.compressed_size = batch_data[i].size();
+                    record.flags = PackfileEntry::Compressed;
+                    compressed_data_size += batch_data[i].size();
+                }
+                data_size += item.data.size();
+                data_pos = start + batch_data[i].size();
+                batch_data[i].clear();
+            }
+
+            batch_start = batch_end;
+        }
+    }
+
+    qint64 file_size = data_offset + data_pos;
+
+    writer.seek(base);
+    writer.writeU32(PACKFILE_DESCRIPTOR);
+    writer.writeU32(m_version);
+    switch (m_version) {
+    case 6:
+        writer.pad(0x144); // Runtime variables
+        writer.writeU32(m_flags);
+        writer.writeU32(0); // Sector
+        writer.writeU32(num_files);
+        writer.writeU32(file_size);
+        writer.writeU32(dir_size);
+        writer.writeU32(names.size());
+        writer.writeU32(data_size);
+        writer.writeU32(compressed_data_size);
+        writer.pad(PACKFILE_HEADER_SIZE_6 - (writer.tell() - base));
+        break;
+    case 10:
+        writer.writeU32(0); // Header checksum, unknown and not checked by Packfile
+        writer.writeU32(file_size);
+        writer.writeU32(m_flags);
+        writer.writeU32(num_files);
+        writer.writeU32(dir_size);
+        writer.writeU32(names.size());
+        writer.writeU32(data_size);
+        writer.writeU32(compressed_data_size);
+        break;
+    case 17:
+        writer.writeU32(0); // Header checksum, unknown and not checked by Packfile
+        writer.writeU32(m_flags);
+        writer.writeU32(num_files);
+        writer.writeU32(directories.size());
+        writer.writeU32(dir_size);
+        writer.writeU32(names.size());
+        writer.writeU64(file_size);
+        writer.writeU64(data_size);
+        writer.writeU64(compressed_data_size);
+        writer.writeU64(m_timestamp);
+        writer.writeU64(data_offset);
+        writer.pad(PACKFILE_HEADER_SIZE_17 - (writer.tell() - base));
+        break;
+    }
+
+    writer.seek(base + entries_offset);
+    for (const Record& record : records) {
+        switch (m_version) {
+        case 6:
+            writer.writeU32(record.filename_offset);
+            writer.writeU32(record.start);
+            writer.writeU32(record.size);
+            writer.writeU32(record.compressed_size);
+            writer.writeU32(0); // Parent pointer
+            break;
+        case 10:
+            writer.writeU64(record.filename_offset);
+            writer.writeU32(record.start);
+            writer.writeU32(record.size);
+            writer.writeU32(record.compressed_size);
+            writer.writeU16(record.flags);
+            writer.writeU16(record.alignment);
+            break;
+        case 17:
+            writer.writeU64(record.filename_offset);
+            writer.writeU64(record.filepath_offset);
+            writer.writeU64(record.start);
+            writer.writeU64(record.size);
+            writer.writeU64(record.compressed_size);
+            writer.writeU16(record.flags);
+            writer.writeU32(record.alignment);
+            writer.pad(2);
+            break;
+        }
+    }
+
+    writer.seek(base + file_size);
+}
+
+QByteArray PackfileWriter::compressData(const QByteArray& data) const
+{
+    switch (m_version) {
+        case 6:
+        case 10: return compressZLIB(data, m_compression_level);
+        case 17: return compressLZ4(data, m_compression_level);
+        default: throw ParsingError("Unsupported version");
+    }
+}
+
+int PackfileWriter::getEntriesCount() const {return m_items.size();}
+void PackfileWriter::clear() {m_items.clear();}
+int PackfileWriter::getVersion() const {return m_version;}
+void PackfileWriter::setVersion(int value) {m_version = value;}
+int PackfileWriter::getFlags() const {return m_flags;}
+void PackfileWriter::setFlags(int value) {m_flags = value;}
+qint64 PackfileWriter::getTimestamp() const {return m_timestamp;}
+void PackfileWriter::setTimestamp(qint64 value) {m_timestamp = value;}
+int PackfileWriter::getCompressionLevel() const {return m_compression_level;}
+void PackfileWriter::setCompressionLevel(int value) {m_compression_level = value;}
+int PackfileWriter::getThreadCount() const {return m_num_threads;}
+void PackfileWriter::setThreadCount(int value) {m_num_threads = value;}
+bool PackfileWriter::isBigEndian() const {return m_big_endian;}
+void PackfileWriter::setBigEndian(bool value) {m_big_endian = value;}
+
+}
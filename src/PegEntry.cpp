@@ -1,4 +1,5 @@
 #include <cassert>
+#include <cmath>
 #include <algorithm>
 #include <QtCore/QtGlobal>
 #include <QtCore/QHash>
@@ -8,6 +9,11 @@
 #include <QtCore/QByteArray>
 #include <QtCore/QIODevice>
 
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define SAINTS_HAVE_SSE2
+#endif
+
 #include "crosstex/BC.hpp"
 #include "crosstex/Colors.hpp"
 
@@ -18,15 +24,28 @@
 #include "Saints/TGAFile.hpp"
 #include "Saints/Colors.hpp"
 #include "ByteIO.hpp"
+#include "Layouts.hpp"
+#include "util.hpp"
 
 
 
 namespace Saints {
 
+// Pixels of one level of a mip chain
+struct MipLevel
+{
+    QVector<LDRColor> pixels;
+    int width;
+    int height;
+};
+
 static LDRColor HDRToTGAPixel(Tex::HDRColorA color);
 static Tex::HDRColorA TGAToHDRPixel(LDRColor pixel);
-static QVector<LDRColor> decompressBC(const QByteArray& data, int width, int height, TextureFormat format);
-static QByteArray compressBC(const QVector<LDRColor>& pixels, int width, int height, TextureFormat format);
+static QVector<LDRColor> decompressBC(const QByteArray& data, int width, int height,
+    TextureFormat format, int num_threads);
+static QByteArray compressBC(const QVector<MipLevel>& levels, TextureFormat format,
+    int num_threads);
+static MipLevel downsampleMip(const MipLevel& level, bool linear, int num_threads);
 
 struct format_pair_t
 {
@@ -145,100 +164,58 @@ PegEntry::PegEntry(PegFile& parent) :
 void PegEntry::read13(QIODevice& stream)
 {
     ByteReader reader(stream);
-
-    offset = reader.readS64();
-    width = reader.readU16();
-    height = reader.readU16();
-    bm_fmt = static_cast<TextureFormat>(reader.readU16());
-    pal_fmt = reader.readU16();
-    anim_tiles_width = reader.readU16();
-    anim_tiles_height = reader.readU16();
-    num_frames = reader.readU16();
-    flags = reader.readU16();
-    reader.ignore(8); // Runtime variable
-    pal_size = reader.readU16();
-    fps = reader.readU8();
-    mip_levels = reader.readU8();
-    data_size = reader.readU32();
-    reader.ignore(32); // Runtime variables and padding
+    read13(reader);
 }
 
 void PegEntry::read19(QIODevice& stream)
 {
     ByteReader reader(stream);
+    read19(reader);
+}
 
-    offset = reader.readS64();
-    width = reader.readU16();
-    height = reader.readU16();
-    bm_fmt = static_cast<TextureFormat>(reader.readU16());
-    pal_fmt = reader.readU16();
-    anim_tiles_width = reader.readU16();
-    anim_tiles_height = reader.readU16();
-    depth = reader.readU16();
-    flags = reader.readU16();
-    avg_color.r = reader.readFloat();
-    avg_color.g = reader.readFloat();
-    avg_color.b = reader.readFloat();
-    avg_color.a = reader.readFloat();
-    reader.ignore(8); // Runtime variable (filename)
-    pal_size = reader.readU16();
-    fps = reader.readU8();
-    mip_levels = reader.readU8();
-    data_size = reader.readU32();
-    reader.ignore(32); // Runtime variables
-    num_mips_split = reader.readU32();
-    data_max_size = reader.readU32();
-    reader.ignore(8); // Padding
+void PegEntry::read13(ByteReader& reader)
+{
+    PegEntryLayout::V13::read(*this, reader);
+}
+
+void PegEntry::read19(ByteReader& reader)
+{
+    PegEntryLayout::V19::read(*this, reader);
 }
 
 
 void PegEntry::write13(QIODevice& stream, qint64 data_offset) const
 {
     ByteWriter writer(stream);
-
-    writer.writeS64(data_offset);
-    writer.writeU16(width);
-    writer.writeU16(height);
-    writer.writeU16(static_cast<uint16_t>(bm_fmt));
-    writer.writeU16(pal_fmt);
-    writer.writeU16(anim_tiles_width);
-    writer.writeU16(anim_tiles_height);
-    writer.writeU16(num_frames);
-    writer.writeU16(flags);
-    writer.pad(8);
-    writer.writeU16(pal_size);
-    writer.writeU8(fps);
-    writer.writeU8(mip_levels);
-    writer.writeU32(data.size());
-    writer.pad(32);
+    write13(writer, data_offset);
+    writer.flush();
 }
 
 void PegEntry::write19(QIODevice& stream, qint64 data_offset) const
 {
     ByteWriter writer(stream);
+    write19(writer, data_offset);
+    writer.flush();
+}
 
-    writer.writeS64(data_offset);
-    writer.writeU16(width);
-    writer.writeU16(height);
-    writer.writeU16(static_cast<uint16_t>(bm_fmt));
-    writer.writeU16(pal_fmt);
-    writer.writeU16(anim_tiles_width);
-    writer.writeU16(anim_tiles_height);
-    writer.writeU16(depth);
-    writer.writeU16(flags);
-    writer.writeFloat(avg_color.r);
-    writer.writeFloat(avg_color.g);
-    writer.writeFloat(avg_color.b);
-    writer.writeFloat(avg_color.a);
-    writer.pad(8);
-    writer.writeU16(pal_size);
-    writer.writeU8(fps);
-    writer.writeU8(mip_levels);
-    writer.writeU32(data.size());
-    writer.pad(32);
-    writer.writeU32(num_mips_split);
-    writer.writeU32(data_max_size);
-    writer.pad(8);
+void PegEntry::write13(ByteWriter& writer, qint64 data_offset) const
+{
+    char record[PegEntryLayout::V13::SIZE];
+    bool big_endian = writer.isBigEndian();
+    PegEntryLayout::V13::encode(*this, record, big_endian);
+    PegEntryLayout::V13::encodeField<PegEntryLayout::Offset>(record, data_offset, big_endian);
+    PegEntryLayout::V13::encodeField<PegEntryLayout::DataSize>(record, data.size(), big_endian);
+    writer.write(record, sizeof(record));
+}
+
+void PegEntry::write19(ByteWriter& writer, qint64 data_offset) const
+{
+    char record[PegEntryLayout::V19::SIZE];
+    bool big_endian = writer.isBigEndian();
+    PegEntryLayout::V19::encode(*this, record, big_endian);
+    PegEntryLayout::V19::encodeField<PegEntryLayout::Offset>(record, data_offset, big_endian);
+    PegEntryLayout::V19::encodeField<PegEntryLayout::DataSize>(record, data.size(), big_endian);
+    writer.write(record, sizeof(record));
 }
 
 void PegEntry::fromDDS(const DDSFile& ddsfile)
@@ -253,14 +230,30 @@ void PegEntry::fromDDS(const DDSFile& ddsfile)
     }
 
     data = ddsfile.data;
+    num_mips_split = 0;
+    data_max_size = data.size();
 }
 
-void PegEntry::fromTGA(const TGAFile& tgafile, TextureFormat fmt)
+void PegEntry::fromTGA(const TGAFile& tgafile, TextureFormat fmt, int num_threads)
 {
     width = tgafile.width;
     height = tgafile.height;
     bm_fmt = fmt;
-    data = compressBC(tgafile.pixels, width, height, bm_fmt);
+
+    // Every level halves the previous one down to 1x1, the levels are stored
+    // one after another starting with the full size image
+    bool linear = flags & BM_F_LINEAR_COLOR_SPACE;
+    QVector<MipLevel> levels;
+    levels.append({tgafile.pixels, width, height});
+    while (levels.last().width > 1 || levels.last().height > 1) {
+        MipLevel mip = downsampleMip(levels.last(), linear, num_threads);
+        levels.append(mip);
+    }
+    mip_levels = levels.size();
+    data = compressBC(levels, bm_fmt, num_threads);
+    // No mips are split off, data holds the whole chain
+    num_mips_split = 0;
+    data_max_size = data.size();
 
     avg_color = {0.f, 0.f, 0.f, 0.f};
     bool has_alpha = false;
@@ -329,12 +322,12 @@ DDSFile PegEntry::toDDS() const
     return ddsfile;
 }
 
-TGAFile PegEntry::toTGA() const
+TGAFile PegEntry::toTGA(int num_threads) const
 {
     TGAFile tga;
     tga.width = width;
     tga.height = height;
-    tga.pixels = decompressBC(data, width, height, bm_fmt);
+    tga.pixels = decompressBC(data, width, height, bm_fmt, num_threads);
     tga.data_type = TGAImageType::RGB;
     tga.bits_per_pixel = 32;
     tga.image_attributes = 0x08;
@@ -363,81 +356,272 @@ Tex::HDRColorA TGAToHDRPixel(LDRColor pixel)
     return color;
 }
 
-QVector<LDRColor> decompressBC(const QByteArray& data, int width, int height, TextureFormat format)
+// BC1 to BC5 are decoded with integers and round the interpolated values.
+// The float path through crosstex truncated them, so channels can come out
+// up to two levels higher than in TGAs exported by older versions.
+static LDRColor expand565(quint16 color)
 {
-    int width_blocks = width / 4;
-    int height_blocks = height / 4;
+    int r = (color >> 11) & 0x1F;
+    int g = (color >> 5) & 0x3F;
+    int b = color & 0x1F;
+    return {
+        static_cast<quint8>((r << 3) | (r >> 2)),
+        static_cast<quint8>((g << 2) | (g >> 4)),
+        static_cast<quint8>((b << 3) | (b >> 2)),
+        0xFF
+    };
+}
 
-    Tex::BC_DECODE decompress_func;
-    int block_size;
+// (a * weight_a + b * weight_b) / divisor per channel, rounded
+static LDRColor blendColors(LDRColor a, LDRColor b, int weight_a, int weight_b)
+{
+    int divisor = weight_a + weight_b;
+    int rounding = divisor / 2;
+    return {
+        static_cast<quint8>((a.r * weight_a + b.r * weight_b + rounding) / divisor),
+        static_cast<quint8>((a.g * weight_a + b.g * weight_b + rounding) / divisor),
+        static_cast<quint8>((a.b * weight_a + b.b * weight_b + rounding) / divisor),
+        0xFF
+    };
+}
+
+// Color part of BC1 to BC3, only BC1 has the three color mode
+static void decodeColorBlock(const quint8* block, bool bc1, LDRColor* out, int stride)
+{
+    quint16 color0 = block[0] | (block[1] << 8);
+    quint16 color1 = block[2] | (block[3] << 8);
+    quint32 indices = block[4] | (block[5] << 8) | (block[6] << 16) |
+        (static_cast<quint32>(block[7]) << 24);
+
+    LDRColor palette[4];
+    palette[0] = expand565(color0);
+    palette[1] = expand565(color1);
+    if (bc1 && color0 <= color1) {
+        palette[2] = blendColors(palette[0], palette[1], 1, 1);
+        palette[3] = {0, 0, 0, 0};
+    } else {
+        palette[2] = blendColors(palette[0], palette[1], 2, 1);
+        palette[3] = blendColors(palette[0], palette[1], 1, 2);
+    }
+
+    for (int texel_y = 0; texel_y < 4; texel_y++) {
+        LDRColor* row = out + texel_y * stride;
+        for (int texel_x = 0; texel_x < 4; texel_x++) {
+            row[texel_x] = palette[indices & 0x3];
+            indices >>= 2;
+        }
+    }
+}
+
+// Alpha part of BC3 and the channels of BC4 and BC5
+static void decodeChannelBlock(const quint8* block, quint8 values[16])
+{
+    int value0 = block[0];
+    int value1 = block[1];
+    quint64 indices = 0;
+    for (int i = 0; i < 6; i++) {
+        indices |= static_cast<quint64>(block[2 + i]) << (i * 8);
+    }
+
+    quint8 palette[8];
+    palette[0] = value0;
+    palette[1] = value1;
+    if (value0 > value1) {
+        for (int i = 1; i < 7; i++) {
+            palette[i + 1] = ((7 - i) * value0 + i * value1 + 3) / 7;
+        }
+    } else {
+        for (int i = 1; i < 5; i++) {
+            palette[i + 1] = ((5 - i) * value0 + i * value1 + 2) / 5;
+        }
+        palette[6] = 0x00;
+        palette[7] = 0xFF;
+    }
+
+    for (int i = 0; i < 16; i++) {
+        values[i] = palette[indices & 0x7];
+        indices >>= 3;
+    }
+}
+
+// Block decoders write a 4x4 block to out, rows are stride pixels apart
+
+struct BC1Decoder
+{
+    static constexpr int BLOCK_SIZE = 8;
+
+    static void decode(const quint8* block, LDRColor* out, int stride)
+    {
+        decodeColorBlock(block, true, out, stride);
+    }
+};
+
+struct BC2Decoder
+{
+    static constexpr int BLOCK_SIZE = 16;
+
+    static void decode(const quint8* block, LDRColor* out, int stride)
+    {
+        decodeColorBlock(block + 8, false, out, stride);
+        for (int texel_y = 0; texel_y < 4; texel_y++) {
+            LDRColor* row = out + texel_y * stride;
+            quint16 alpha = block[texel_y * 2] | (block[texel_y * 2 + 1] << 8);
+            for (int texel_x = 0; texel_x < 4; texel_x++) {
+                row[texel_x].a = (alpha & 0xF) * 0x11;
+                alpha >>= 4;
+            }
+        }
+    }
+};
+
+struct BC3Decoder
+{
+    static constexpr int BLOCK_SIZE = 16;
+
+    static void decode(const quint8* block, LDRColor* out, int stride)
+    {
+        quint8 alpha[16];
+        decodeChannelBlock(block, alpha);
+        decodeColorBlock(block + 8, false, out, stride);
+        for (int texel_y = 0; texel_y < 4; texel_y++) {
+            LDRColor* row = out + texel_y * stride;
+            for (int texel_x = 0; texel_x < 4; texel_x++) {
+                row[texel_x].a = alpha[texel_y * 4 + texel_x];
+            }
+        }
+    }
+};
+
+struct BC4Decoder
+{
+    static constexpr int BLOCK_SIZE = 8;
+
+    static void decode(const quint8* block, LDRColor* out, int stride)
+    {
+        quint8 red[16];
+        decodeChannelBlock(block, red);
+        for (int texel_y = 0; texel_y < 4; texel_y++) {
+            LDRColor* row = out + texel_y * stride;
+            for (int texel_x = 0; texel_x < 4; texel_x++) {
+                row[texel_x] = {red[texel_y * 4 + texel_x], 0, 0, 0xFF};
+            }
+        }
+    }
+};
+
+struct BC5Decoder
+{
+    static constexpr int BLOCK_SIZE = 16;
+
+    static void decode(const quint8* block, LDRColor* out, int stride)
+    {
+        quint8 red[16];
+        quint8 green[16];
+        decodeChannelBlock(block, red);
+        decodeChannelBlock(block + 8, green);
+        for (int texel_y = 0; texel_y < 4; texel_y++) {
+            LDRColor* row = out + texel_y * stride;
+            for (int texel_x = 0; texel_x < 4; texel_x++) {
+                int i = texel_y * 4 + texel_x;
+                row[texel_x] = {red[i], green[i], 0, 0xFF};
+            }
+        }
+    }
+};
+
+// BC6H and BC7 go through crosstex and are converted from floats
+template<Tex::BC_DECODE DecodeFunc, int BlockSize>
+struct HDRDecoder
+{
+    static constexpr int BLOCK_SIZE = BlockSize;
+
+    static void decode(const quint8* block, LDRColor* out, int stride)
+    {
+        Tex::HDRColorA block_texels[16];
+        DecodeFunc(block_texels, block);
+        for (int texel_y = 0; texel_y < 4; texel_y++) {
+            LDRColor* row = out + texel_y * stride;
+            for (int texel_x = 0; texel_x < 4; texel_x++) {
+                row[texel_x] = HDRToTGAPixel(block_texels[texel_y * 4 + texel_x]);
+            }
+        }
+    }
+};
+
+template<typename Decoder>
+static QVector<LDRColor> decodeBlocks(const QByteArray& data, int width, int height,
+    int num_threads)
+{
+    if (width <= 0 || height <= 0) {
+        return QVector<LDRColor>();
+    }
+
+    int width_blocks = (width + 3) / 4;
+    int height_blocks = (height + 3) / 4;
+    if (data.size() < static_cast<qint64>(width_blocks) * height_blocks * Decoder::BLOCK_SIZE) {
+        throw ParsingError("Texture data is smaller than its dimensions");
+    }
+
+    QVector<LDRColor> pixels(width * height);
+    LDRColor* pixels_p = pixels.data();
+    const quint8* data_p = reinterpret_cast<const quint8*>(data.constData());
+    // A row of blocks is read sequentially and fills four whole pixel rows
+    parallelFor(height_blocks, num_threads, [&](int block_y) {
+        const quint8* data_row_p = data_p + block_y * width_blocks * Decoder::BLOCK_SIZE;
+        LDRColor* pixel_row_p = pixels_p + block_y * 4 * width;
+        int block_height = std::min(4, height - block_y * 4);
+        for (int block_x = 0; block_x < width_blocks; block_x++) {
+            const quint8* block_p = data_row_p + block_x * Decoder::BLOCK_SIZE;
+            LDRColor* block_pixels_p = pixel_row_p + block_x * 4;
+            int block_width = std::min(4, width - block_x * 4);
+            if (block_width == 4 && block_height == 4) {
+                Decoder::decode(block_p, block_pixels_p, width);
+                continue;
+            }
+
+            // Blocks on the edges of other sizes are decoded aside and cropped
+            LDRColor block[16];
+            Decoder::decode(block_p, block, 4);
+            for (int texel_y = 0; texel_y < block_height; texel_y++) {
+                for (int texel_x = 0; texel_x < block_width; texel_x++) {
+                    block_pixels_p[texel_y * width + texel_x] = block[texel_y * 4 + texel_x];
+                }
+            }
+        }
+    });
+
+    return pixels;
+}
+
+QVector<LDRColor> decompressBC(const QByteArray& data, int width, int height,
+    TextureFormat format, int num_threads)
+{
     switch(format)
     {
     case TextureFormat::PC_BC1:
-        decompress_func = Tex::DecodeBC1;
-        block_size = 8;
-        break;
+        return decodeBlocks<BC1Decoder>(data, width, height, num_threads);
     case TextureFormat::PC_BC2:
-        decompress_func = Tex::DecodeBC2;
-        block_size = 16;
-        break;
+        return decodeBlocks<BC2Decoder>(data, width, height, num_threads);
     case TextureFormat::PC_BC3:
-        decompress_func = Tex::DecodeBC3;
-        block_size = 16;
-        break;
+        return decodeBlocks<BC3Decoder>(data, width, height, num_threads);
     case TextureFormat::PC_BC4:
-        decompress_func = Tex::DecodeBC4U;
-        block_size = 8;
-        break;
+        return decodeBlocks<BC4Decoder>(data, width, height, num_threads);
     case TextureFormat::PC_BC5:
-        decompress_func = Tex::DecodeBC5U;
-        block_size = 16;
-        break;
+        return decodeBlocks<BC5Decoder>(data, width, height, num_threads);
     case TextureFormat::PC_BC6HU:
-        decompress_func = Tex::DecodeBC6HU;
-        block_size = 16;
-        break;
+        return decodeBlocks<HDRDecoder<Tex::DecodeBC6HU, 16>>(data, width, height, num_threads);
     case TextureFormat::PC_BC6HS:
-        decompress_func = Tex::DecodeBC6HS;
-        block_size = 16;
-        break;
+        return decodeBlocks<HDRDecoder<Tex::DecodeBC6HS, 16>>(data, width, height, num_threads);
     case TextureFormat::PC_BC7:
-        decompress_func = Tex::DecodeBC7;
-        block_size = 16;
-        break;
+        return decodeBlocks<HDRDecoder<Tex::DecodeBC7, 16>>(data, width, height, num_threads);
     default:
         throw ParsingError("Unknown texture format");
     }
-
-    QVector<LDRColor> pixels(width * height);
-    for (int block_x = 0; block_x < width_blocks; block_x++) {
-        for (int block_y = 0; block_y < height_blocks; block_y++) {
-            int data_pos = (block_y * width_blocks + block_x) * block_size;
-            const char* data_block_p = data.constData() + data_pos;
-            Tex::HDRColorA block_texels[16];
-            decompress_func(
-                block_texels,
-                reinterpret_cast<const uint8_t*>(data_block_p)
-            );
-            for (int texel_x = 0; texel_x < 4; texel_x++) {
-                for (int texel_y = 0; texel_y < 4; texel_y++) {
-                    int absolute_x = block_x * 4 + texel_x;
-                    int absolute_y = block_y * 4 + texel_y;
-                    int texel_pos = absolute_y * width + absolute_x;
-                    int block_pos = texel_y * 4 + texel_x;
-                    pixels[texel_pos] = HDRToTGAPixel(block_texels[block_pos]);
-                }
-            }
-        }
-    }
-
-    return pixels;
 }
 
-QByteArray compressBC(const QVector<LDRColor>& pixels, int width, int height, TextureFormat format)
+QByteArray compressBC(const QVector<MipLevel>& levels, TextureFormat format,
+    int num_threads)
 {
-    int width_blocks = width / 4;
-    int height_blocks = height / 4;
-
     Tex::BC_ENCODE compress_func;
     int block_size;
     switch(format)
@@ -478,19 +662,47 @@ QByteArray compressBC(const QVector<LDRColor>& pixels, int width, int height, Te
         throw ParsingError("Unknown texture format");
     }
 
-    QByteArray data(width_blocks * height_blocks * block_size, 0x00);
-    for (int block_x = 0; block_x < width_blocks; block_x++) {
-        for (int block_y = 0; block_y < height_blocks; block_y++) {
-            int data_pos = (block_y * width_blocks + block_x) * block_size;
-            char* data_block_p = data.data() + data_pos;
+    // Every level takes at least one block, partial blocks are padded
+    QVector<qint64> level_offsets;
+    QVector<int> level_block_rows;
+    qint64 data_size = 0;
+    int num_block_rows = 0;
+    for (const MipLevel& level : levels) {
+        level_offsets.append(data_size);
+        level_block_rows.append(num_block_rows);
+        data_size += calcCompressedSize(level.width, level.height, block_size);
+        num_block_rows += std::max(1, (level.height + 3) / 4);
+    }
+
+    QByteArray data(data_size, 0x00);
+    char* data_p = data.data();
+    // Blocks are independent, every thread encodes whole rows of them into
+    // their fixed position, so the output doesn't depend on the scheduling.
+    // The rows of all levels are shared out together, which keeps the
+    // threads busy on the small levels too.
+    parallelFor(num_block_rows, num_threads, [&](int block_row) {
+        int level_index = levels.size() - 1;
+        while (level_block_rows[level_index] > block_row) {
+            level_index--;
+        }
+        const MipLevel& level = levels[level_index];
+        const LDRColor* pixels_p = level.pixels.constData();
+        int block_y = block_row - level_block_rows[level_index];
+        int width_blocks = std::max(1, (level.width + 3) / 4);
+        char* data_row_p = data_p + level_offsets[level_index] +
+            block_y * width_blocks * block_size;
+
+        for (int block_x = 0; block_x < width_blocks; block_x++) {
+            char* data_block_p = data_row_p + block_x * block_size;
             Tex::HDRColorA block_texels[16];
             for (int texel_x = 0; texel_x < 4; texel_x++) {
                 for (int texel_y = 0; texel_y < 4; texel_y++) {
-                    int absolute_x = block_x * 4 + texel_x;
-                    int absolute_y = block_y * 4 + texel_y;
-                    int texel_pos = absolute_y * width + absolute_x;
+                    // Texels past the edge repeat the last row and column
+                    int absolute_x = std::min(block_x * 4 + texel_x, level.width - 1);
+                    int absolute_y = std::min(block_y * 4 + texel_y, level.height - 1);
+                    int texel_pos = absolute_y * level.width + absolute_x;
                     int block_pos = texel_y * 4 + texel_x;
-                    block_texels[block_pos] = TGAToHDRPixel(pixels[texel_pos]);
+                    block_texels[block_pos] = TGAToHDRPixel(pixels_p[texel_pos]);
                 }
             }
             compress_func(
@@ -499,9 +711,154 @@ QByteArray compressBC(const QVector<LDRColor>& pixels, int width, int height, Te
                 Tex::BC_FLAGS_NONE
             );
         }
-    }
+    });
 
     return data;
 }
 
+// Conversion between sRGB and linear values for filtering
+struct GammaTables
+{
+    float to_linear[256];
+    quint8 to_srgb[4096]; // Indexed by the linear value scaled to 4095
+
+    GammaTables()
+    {
+        for (int i = 0; i < 256; i++) {
+            float value = i / 255.f;
+            if (value <= 0.04045f) {
+                to_linear[i] = value / 12.92f;
+            } else {
+                to_linear[i] = std::pow((value + 0.055f) / 1.055f, 2.4f);
+            }
+        }
+        for (int i = 0; i < 4096; i++) {
+            float value = i / 4095.f;
+            if (value <= 0.0031308f) {
+                value *= 12.92f;
+            } else {
+                value = 1.055f * std::pow(value, 1.f / 2.4f) - 0.055f;
+            }
+            to_srgb[i] = static_cast<quint8>(value * 255.f + 0.5f);
+        }
+    }
+};
+
+static const GammaTables& getGammaTables()
+{
+    static const GammaTables tables;
+    return tables;
+}
+
+#ifdef SAINTS_HAVE_SSE2
+// Both downsampleRow functions filter the first count mip pixels of a row,
+// whose source pixels need no clamping, and return how many they did. The
+// results match the scalar loop in downsampleMip exactly.
+
+static int downsampleRowLinear(const LDRColor* row0_p, const LDRColor* row1_p,
+    LDRColor* mip_row_p, int count)
+{
+    // Four source pixels of each row make two mip pixels, summed in 16 bits
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i rounding = _mm_set1_epi16(2);
+    int x = 0;
+    for (; x + 2 <= count; x += 2) {
+        __m128i row0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row0_p + x * 2));
+        __m128i row1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row1_p + x * 2));
+        __m128i sum_lo = _mm_add_epi16(
+            _mm_unpacklo_epi8(row0, zero), _mm_unpacklo_epi8(row1, zero));
+        __m128i sum_hi = _mm_add_epi16(
+            _mm_unpackhi_epi8(row0, zero), _mm_unpackhi_epi8(row1, zero));
+        __m128i sum = _mm_add_epi16(
+            _mm_unpacklo_epi64(sum_lo, sum_hi), _mm_unpackhi_epi64(sum_lo, sum_hi));
+        sum = _mm_srli_epi16(_mm_add_epi16(sum, rounding), 2);
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(mip_row_p + x), _mm_packus_epi16(sum, sum));
+    }
+    return x;
+}
+
+static int downsampleRowSRGB(const LDRColor* row0_p, const LDRColor* row1_p,
+    LDRColor* mip_row_p, int count, const GammaTables& tables)
+{
+    // The table lookups stay scalar, the channels are summed and scaled together
+    const float* l = tables.to_linear;
+    const __m128 scale = _mm_set1_ps(4095.f / 4.f);
+    const __m128 rounding = _mm_set1_ps(0.5f);
+    for (int x = 0; x < count; x++) {
+        const LDRColor* p0 = row0_p + x * 2;
+        const LDRColor* p1 = row1_p + x * 2;
+        __m128 sum = _mm_set_ps(0.f, l[p0[0].b], l[p0[0].g], l[p0[0].r]);
+        sum = _mm_add_ps(sum, _mm_set_ps(0.f, l[p0[1].b], l[p0[1].g], l[p0[1].r]));
+        sum = _mm_add_ps(sum, _mm_set_ps(0.f, l[p1[0].b], l[p1[0].g], l[p1[0].r]));
+        sum = _mm_add_ps(sum, _mm_set_ps(0.f, l[p1[1].b], l[p1[1].g], l[p1[1].r]));
+        alignas(16) qint32 indices[4];
+        _mm_store_si128(reinterpret_cast<__m128i*>(indices),
+            _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(sum, scale), rounding)));
+
+        LDRColor& out = mip_row_p[x];
+        out.r = tables.to_srgb[indices[0]];
+        out.g = tables.to_srgb[indices[1]];
+        out.b = tables.to_srgb[indices[2]];
+        out.a = (p0[0].a + p0[1].a + p1[0].a + p1[1].a + 2) / 4;
+    }
+    return count;
+}
+#endif
+
+// Averages 2x2 pixels into one, color in linear space unless the pixels are
+// linear already. Alpha is always averaged as is.
+MipLevel downsampleMip(const MipLevel& level, bool linear, int num_threads)
+{
+    const GammaTables& tables = getGammaTables();
+
+    MipLevel mip;
+    mip.width = std::max(1, level.width / 2);
+    mip.height = std::max(1, level.height / 2);
+    mip.pixels.resize(mip.width * mip.height);
+
+    const LDRColor* pixels_p = level.pixels.constData();
+    LDRColor* mip_pixels_p = mip.pixels.data();
+    parallelFor(mip.height, num_threads, [&](int y) {
+        // Sides of one pixel are repeated
+        const LDRColor* row0_p = pixels_p + std::min(y * 2, level.height - 1) * level.width;
+        const LDRColor* row1_p = pixels_p + std::min(y * 2 + 1, level.height - 1) * level.width;
+        LDRColor* mip_row_p = mip_pixels_p + y * mip.width;
+        int x = 0;
+#ifdef SAINTS_HAVE_SSE2
+        if (linear) {
+            x = downsampleRowLinear(row0_p, row1_p, mip_row_p, level.width / 2);
+        } else {
+            x = downsampleRowSRGB(row0_p, row1_p, mip_row_p, level.width / 2, tables);
+        }
+#endif
+        for (; x < mip.width; x++) {
+            int x0 = std::min(x * 2, level.width - 1);
+            int x1 = std::min(x * 2 + 1, level.width - 1);
+            LDRColor p00 = row0_p[x0];
+            LDRColor p01 = row0_p[x1];
+            LDRColor p10 = row1_p[x0];
+            LDRColor p11 = row1_p[x1];
+
+            LDRColor& out = mip_row_p[x];
+            if (linear) {
+                out.r = (p00.r + p01.r + p10.r + p11.r + 2) / 4;
+                out.g = (p00.g + p01.g + p10.g + p11.g + 2) / 4;
+                out.b = (p00.b + p01.b + p10.b + p11.b + 2) / 4;
+            } else {
+                const float* l = tables.to_linear;
+                float scale = 4095.f / 4.f;
+                out.r = tables.to_srgb[static_cast<int>(
+                    (l[p00.r] + l[p01.r] + l[p10.r] + l[p11.r]) * scale + 0.5f)];
+                out.g = tables.to_srgb[static_cast<int>(
+                    (l[p00.g] + l[p01.g] + l[p10.g] + l[p11.g]) * scale + 0.5f)];
+                out.b = tables.to_srgb[static_cast<int>(
+                    (l[p00.b] + l[p01.b] + l[p10.b] + l[p11.b]) * scale + 0.5f)];
+            }
+            out.a = (p00.a + p01.a + p10.a + p11.a + 2) / 4;
+        }
+    });
+
+    return mip;
+}
+
 }
@@ -1,12 +1,14 @@
 #include <cassert>
 #include <QtCore/QtGlobal>
 #include <QtCore/QString>
+#include <QtCore/QByteArray>
 #include <QtCore/QIODevice>
 
 #include "Saints/PegFile.hpp"
 #include "Saints/PegEntry.hpp"
 #include "Saints/Exceptions.hpp"
 #include "ByteIO.hpp"
+#include "Layouts.hpp"
 #include "util.hpp"
 
 
@@ -24,6 +26,7 @@ PegFile::PegFile()
     data_size = 0;
     flags = 0;
     alignment = 16;
+    big_endian = false;
 }
 
 PegFile::PegFile(QIODevice& header_stream) :
@@ -51,9 +54,16 @@ void PegFile::open(QIODevice& header_stream, QIODevice& data_stream)
 
 void PegFile::readHeader(QIODevice& stream)
 {
-    ByteReader reader(stream);
+    // Header files are small, parse them from memory
+    QByteArray header(stream.readAll());
+    ByteReader reader(header);
 
     quint32 signature = reader.readU32();
+    big_endian = signature == swapBytes(PEG_SIGNATURE);
+    if (big_endian) {
+        signature = PEG_SIGNATURE;
+    }
+    reader.setBigEndian(big_endian);
     version = reader.readS16();
     platform = reader.readS16();
     header_size = reader.readU32();
@@ -81,12 +91,10 @@ void PegFile::readHeader(QIODevice& stream)
         reader.align(16);
     }
 
-    for (int entry_i = 0; entry_i < total_entries; entry_i++) {
-        PegEntry entry(*this);
-        if (version == 13) entry.read13(stream);
-        if (version == 19) entry.read19(stream);
-        entries.push_back(entry);
-    }
+    // The entry table is decoded in one pass
+    entries = QVector<PegEntry>(total_entries, PegEntry(*this));
+    if (version == 13) PegEntryLayout::V13::readArray(entries.data(), total_entries, reader);
+    if (version == 19) PegEntryLayout::V19::readArray(entries.data(), total_entries, reader);
 
     for (PegEntry& entry : entries) {
         entry.filename = reader.readCString();
@@ -96,6 +104,7 @@ void PegFile::readHeader(QIODevice& stream)
 void PegFile::writeHeader(QIODevice& stream) const
 {
     ByteWriter writer(stream);
+    writer.setBigEndian(big_endian);
 
     writer.writeU32(PEG_SIGNATURE);
     writer.writeS16(version);
@@ -115,8 +124,8 @@ void PegFile::writeHeader(QIODevice& stream) const
     for (const PegEntry& entry : entries) {
         data_offset = alignAddress(data_offset, alignment);
         switch (version) {
-            case 13: entry.write13(stream, data_offset); break;
-            case 19: entry.write19(stream, data_offset); break;
+            case 13: entry.write13(writer, data_offset); break;
+            case 19: entry.write19(writer, data_offset); break;
             default: throw ParsingError("Unsupported version");
         }
         data_offset += entry.data.size();
@@ -128,6 +137,7 @@ void PegFile::writeHeader(QIODevice& stream) const
         }
         writer.writeCString(entry.filename);
     }
+    writer.flush();
 }
 
 void PegFile::readData(QIODevice& stream)
@@ -148,6 +158,7 @@ void PegFile::writeData(QIODevice& stream) const
         writer.align(alignment);
         writer.write(entry.data);
     }
+    writer.flush();
 }
 
 int PegFile::calcHeaderSize() const
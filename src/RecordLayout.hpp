@@ -0,0 +1,233 @@
+#pragma once
+#include <string.h>
+#include <QtCore/QtGlobal>
+#include <QtCore/QByteArray>
+#include <QtCore/QString>
+
+#include "Saints/Exceptions.hpp"
+#include "ByteIO.hpp"
+#include "util.hpp"
+
+
+
+namespace Saints {
+
+// Building blocks of a Layout. Every field occupies SIZE bytes directly
+// after the previous one and converts between the stored type in either
+// byte order and the record member.
+
+// A member stored as a Stored value
+template<typename Record, typename Stored, typename Member, Member Record::*Ptr>
+struct Field
+{
+    static constexpr qint64 SIZE = sizeof(Stored);
+
+    static void decode(Record& record, const char* data, bool big_endian)
+    {
+        Stored value;
+        memcpy(&value, data, sizeof(Stored));
+        if (big_endian) {
+            value = swapBytes(value);
+        }
+        record.*Ptr = static_cast<Member>(value);
+    }
+
+    static void encode(const Record& record, char* data, bool big_endian)
+    {
+        encodeValue(record.*Ptr, data, big_endian);
+    }
+
+    template<typename T>
+    static void encodeValue(T value, char* data, bool big_endian)
+    {
+        Stored stored = static_cast<Stored>(value);
+        if (big_endian) {
+            stored = swapBytes(stored);
+        }
+        memcpy(data, &stored, sizeof(Stored));
+    }
+};
+
+// A member array of numbers
+template<typename Record, typename T, int Count, T (Record::*Ptr)[Count]>
+struct ArrayField
+{
+    static constexpr qint64 SIZE = sizeof(T) * Count;
+
+    static void decode(Record& record, const char* data, bool big_endian)
+    {
+        T* values = record.*Ptr;
+        memcpy(values, data, SIZE);
+        if (big_endian) {
+            for (int i = 0; i < Count; i++) {
+                values[i] = swapBytes(values[i]);
+            }
+        }
+    }
+
+    static void encode(const Record& record, char* data, bool big_endian)
+    {
+        const T* values = record.*Ptr;
+        for (int i = 0; i < Count; i++) {
+            T value = big_endian ? swapBytes(values[i]) : values[i];
+            memcpy(data + i * sizeof(T), &value, sizeof(T));
+        }
+    }
+};
+
+// A member with a layout of its own
+template<typename Record, typename Member, Member Record::*Ptr, typename MemberLayout>
+struct NestedField
+{
+    static constexpr qint64 SIZE = MemberLayout::SIZE;
+
+    static void decode(Record& record, const char* data, bool big_endian)
+    {
+        MemberLayout::decode(record.*Ptr, data, big_endian);
+    }
+
+    static void encode(const Record& record, char* data, bool big_endian)
+    {
+        MemberLayout::encode(record.*Ptr, data, big_endian);
+    }
+};
+
+// The size of the record itself, which has to match on decode
+template<typename Stored, Stored Value>
+struct SizeField
+{
+    static constexpr qint64 SIZE = sizeof(Stored);
+
+    template<typename Record>
+    static void decode(Record&, const char* data, bool big_endian)
+    {
+        Stored value;
+        memcpy(&value, data, sizeof(Stored));
+        if (big_endian) {
+            value = swapBytes(value);
+        }
+        if (value != Value) {
+            throw FieldError("size", QString::number(value));
+        }
+    }
+
+    template<typename Record>
+    static void encode(const Record&, char* data, bool big_endian)
+    {
+        Stored value = big_endian ? swapBytes(Value) : Value;
+        memcpy(data, &value, sizeof(Stored));
+    }
+};
+
+// Skipped on decode, zeroed on encode
+template<qint64 Size>
+struct Padding
+{
+    static constexpr qint64 SIZE = Size;
+
+    template<typename Record>
+    static void decode(Record&, const char*, bool)
+    {
+
+    }
+
+    template<typename Record>
+    static void encode(const Record&, char* data, bool)
+    {
+        memset(data, 0, Size);
+    }
+};
+
+template<typename Target, typename... Fields>
+struct FieldOffset;
+
+template<typename Target, typename... Rest>
+struct FieldOffset<Target, Target, Rest...>
+{
+    static constexpr qint64 value = 0;
+};
+
+template<typename Target, typename First, typename... Rest>
+struct FieldOffset<Target, First, Rest...>
+{
+    static constexpr qint64 value = First::SIZE + FieldOffset<Target, Rest...>::value;
+};
+
+// Describes a binary record as a sequence of fields. The offsets are
+// resolved at compile time, so decoding is a chain of fixed size copies
+// from a buffer that is bounds checked once.
+template<typename Record, typename... Fields>
+struct Layout;
+
+template<typename Record>
+struct Layout<Record>
+{
+    static constexpr qint64 SIZE = 0;
+
+    static void decode(Record&, const char*, bool)
+    {
+
+    }
+
+    static void encode(const Record&, char*, bool)
+    {
+
+    }
+};
+
+template<typename Record, typename First, typename... Rest>
+struct Layout<Record, First, Rest...>
+{
+    typedef Layout<Record, Rest...> Tail;
+    static constexpr qint64 SIZE = First::SIZE + Tail::SIZE;
+
+    static void decode(Record& record, const char* data, bool big_endian = false)
+    {
+        First::decode(record, data, big_endian);
+        Tail::decode(record, data + First::SIZE, big_endian);
+    }
+
+    static void encode(const Record& record, char* data, bool big_endian = false)
+    {
+        First::encode(record, data, big_endian);
+        Tail::encode(record, data + First::SIZE, big_endian);
+    }
+
+    // Overwrites a single field of an encoded record
+    template<typename Target, typename T>
+    static void encodeField(char* data, T value, bool big_endian = false)
+    {
+        Target::encodeValue(value, data + FieldOffset<Target, First, Rest...>::value, big_endian);
+    }
+
+    static void decodeArray(Record* records, int count, const char* data,
+        bool big_endian = false)
+    {
+        for (int i = 0; i < count; i++) {
+            decode(records[i], data + i * SIZE, big_endian);
+        }
+    }
+
+    // Reads in the byte order of the reader
+    static void read(Record& record, ByteReader& reader)
+    {
+        char data[SIZE];
+        reader.read(data, SIZE);
+        decode(record, data, reader.isBigEndian());
+    }
+
+    static void readArray(Record* records, int count, ByteReader& reader)
+    {
+        QByteArray data(reader.read(count * SIZE));
+        decodeArray(records, count, data.constData(), reader.isBigEndian());
+    }
+
+    static void write(const Record& record, ByteWriter& writer)
+    {
+        char data[SIZE];
+        encode(record, data, writer.isBigEndian());
+        writer.write(data, SIZE);
+    }
+};
+
+}
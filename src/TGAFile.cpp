@@ -2,7 +2,6 @@
 #include <QtCore/QIODevice>
 #include <QtCore/QByteArray>
 #include <QtCore/QVector>
-#include <QtCore/QBuffer>
 #include <algorithm>
 
 #include "Saints/TGAFile.hpp"
@@ -89,9 +88,7 @@ void TGAFile::read(QIODevice& stream)
     } else {
         image_data = reader.read(num_bytes);
     }
-    QBuffer image_buffer(&image_data);
-    image_buffer.open(QIODevice::ReadOnly);
-    ByteReader image_reader(image_buffer);
+    ByteReader image_reader(image_data);
 
     pixels.clear();
     for (int i_pixel = 0; i_pixel < width * height; i_pixel++) {
@@ -164,6 +161,7 @@ void TGAFile::write(QIODevice& stream)
             writer.writeU8(pixel.a);
         }
     }
+    writer.flush();
 }
 
 void TGAFile::checkDataType(TGAImageType data_type)
@@ -1,74 +1,682 @@
 #include <assert.h>
 #include <stddef.h>
+#include <string.h>
+#include <exception>
+#include <algorithm>
+#include <limits>
+#include <memory>
+#include <vector>
 #include <QtCore/QtGlobal>
 #include <QtCore/QByteArray>
+#include <QtCore/QString>
 #include <QtCore/QIODevice>
+#include <QtCore/QAtomicInt>
+#include <QtCore/QMutex>
+#include <QtCore/QMutexLocker>
+#include <QtCore/QWaitCondition>
+#include <QtCore/QRunnable>
+#include <QtCore/QThread>
+#include <QtCore/QThreadPool>
+#include <QtCore/QVector>
+#include <QtCore/QtEndian>
 
 #include "zlib.h"
+#include "lz4.h"
 #include "lz4frame.h"
+#ifdef SAINTS_HAVE_ZLIB_NG
+#include "zlib-ng.h"
+#endif
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define SAINTS_HAVE_SSE2
+#endif
+#ifdef SAINTS_HAVE_LIBDEFLATE
+#include "libdeflate.h"
+#endif
 
 #include "util.hpp"
+#include "Saints/Compression.hpp"
 #include "Saints/Exceptions.hpp"
 
 constexpr qint64 CHUNK_SIZE = 16384;
+// Released codec contexts and scratch buffers kept per thread and type
+constexpr size_t MAX_CACHED_CONTEXTS = 4;
+// Smaller LZ4 frames are not worth starting threads for
+constexpr qint64 PARALLEL_LZ4_MIN_SIZE = 4 * 1024 * 1024;
+// Magic, flags, block descriptor and header checksum
+constexpr qint64 LZ4_FRAME_HEADER_MIN = 7;
+constexpr quint8 LZ4_FLAG_DICT_ID = (1 << 0);
+constexpr quint8 LZ4_FLAG_CONTENT_CHECKSUM = (1 << 2);
+constexpr quint8 LZ4_FLAG_CONTENT_SIZE = (1 << 3);
+constexpr quint8 LZ4_FLAG_BLOCK_CHECKSUM = (1 << 4);
+constexpr quint8 LZ4_FLAG_BLOCK_INDEPENDENT = (1 << 5);
 
 
 
 namespace Saints {
 
-QByteArray decompressZLIB(QIODevice& stream)
+class FunctionRunnable : public QRunnable
 {
-    QByteArray out_data;
+public:
+    explicit FunctionRunnable(const std::function<void()>& func) :
+        m_func(func)
+    {
 
-    QByteArray in_buffer(CHUNK_SIZE, 0);
-    QByteArray out_buffer(CHUNK_SIZE, 0);
+    }
 
-    int ret;
-    z_stream zstrm;
-    zstrm.zalloc = Z_NULL;
-    zstrm.zfree = Z_NULL;
-    zstrm.opaque = Z_NULL;
-    zstrm.avail_in = 0;
-    zstrm.next_in = Z_NULL;
-    ret = inflateInit(&zstrm);
+    void run() override
+    {
+        m_func();
+    }
 
-    if (ret != Z_OK) {
-        throw std::runtime_error("Failed to initialize zlib");
+private:
+    std::function<void()> m_func;
+};
+
+int resolveThreadCount(int num_threads)
+{
+    if (num_threads > 0) {
+        return num_threads;
+    }
+    return qMax(1, QThread::idealThreadCount());
+}
+
+// State of one parallelFor call. Helpers that start after the call returned
+// only see that every index is taken, so they keep it alive themselves.
+struct ParallelForState
+{
+    const std::function<void(int)>* func;
+    int count;
+    QAtomicInt next_index;
+    QAtomicInt cancelled;
+    QMutex mutex;
+    QWaitCondition done;
+    int active; // Threads inside run(), guarded by mutex
+    std::exception_ptr error;
+
+    void run()
+    {
+        while (!cancelled.loadAcquire()) {
+            int index = next_index.fetchAndAddRelaxed(1);
+            if (index >= count) {
+                break;
+            }
+            try {
+                (*func)(index);
+            } catch (...) {
+                QMutexLocker lock(&mutex);
+                if (!error) {
+                    error = std::current_exception();
+                }
+                cancelled.storeRelease(1);
+            }
+        }
+    }
+};
+
+// Threads outlive the calls, so their thread local decompression contexts
+// are reused by later calls too
+static QThreadPool& getWorkerPool()
+{
+    static QThreadPool pool;
+    static bool initialized = [] {
+        pool.setMaxThreadCount(resolveThreadCount(0));
+        return true;
+    }();
+    Q_UNUSED(initialized);
+    return pool;
+}
+
+void parallelFor(int count, int num_threads, const std::function<void(int)>& func)
+{
+    num_threads = qMin(resolveThreadCount(num_threads), count);
+    if (num_threads <= 1) {
+        for (int i = 0; i < count; i++) {
+            func(i);
+        }
+        return;
+    }
+
+    std::shared_ptr<ParallelForState> state(new ParallelForState);
+    state->func = &func;
+    state->count = count;
+    state->active = 0;
+
+    auto helper = [state]() {
+        {
+            QMutexLocker lock(&state->mutex);
+            state->active++;
+        }
+        state->run();
+        QMutexLocker lock(&state->mutex);
+        state->active--;
+        state->done.wakeAll();
+    };
+
+    // The calling thread works too, so nested calls finish even when every
+    // pool thread is busy waiting
+    QThreadPool& pool = getWorkerPool();
+    for (int i = 1; i < num_threads; i++) {
+        pool.start(new FunctionRunnable(helper));
+    }
+    state->run();
+
+    // Once every index is taken or the loop was cancelled no helper starts
+    // another call of func, only those still running have to be waited for
+    QMutexLocker lock(&state->mutex);
+    while (state->active > 0) {
+        state->done.wait(&state->mutex);
+    }
+    if (state->error) {
+        std::rethrow_exception(state->error);
+    }
+}
+
+QString decodeCString(const QByteArray& buffer, qint64 offset)
+{
+    if (offset < 0 || offset >= buffer.size()) {
+        throw ParsingError(QString("String offset %1 is out of range").arg(offset));
+    }
+
+    const char* start = buffer.constData() + offset;
+    qint64 max_len = buffer.size() - offset;
+    const char* end = static_cast<const char*>(memchr(start, '\0', max_len));
+    qint64 len = end ? end - start : max_len;
+    return QString::fromUtf8(start, len);
+}
+
+// Takes a released context of the calling thread or creates a new one.
+// Contexts are reset when the lease ends and kept for the next call.
+template<typename Context>
+class ContextLease
+{
+public:
+    typedef typename Context::Type Type;
+
+    ContextLease()
+    {
+        std::vector<Type*>& cached = getCached();
+        bool reused = !cached.empty();
+        if (reused) {
+            m_context = cached.back();
+            cached.pop_back();
+        } else {
+            m_context = Context::create();
+        }
+        if (Context::COUNTED) {
+            countDecompressionContext(reused);
+        }
+    }
+
+    ~ContextLease()
+    {
+        std::vector<Type*>& cached = getCached();
+        if (cached.size() < MAX_CACHED_CONTEXTS && Context::reset(m_context)) {
+            cached.push_back(m_context);
+        } else {
+            Context::destroy(m_context);
+        }
+    }
+
+    ContextLease(const ContextLease& other) = delete;
+    ContextLease& operator=(const ContextLease& other) = delete;
+
+    Type* get() const {return m_context;}
+
+private:
+    struct Cache
+    {
+        std::vector<Type*> contexts;
+        ~Cache()
+        {
+            for (Type* context : contexts) {
+                Context::destroy(context);
+            }
+        }
+    };
+
+    static std::vector<Type*>& getCached()
+    {
+        static thread_local Cache t_cache;
+        return t_cache.contexts;
+    }
+
+    Type* m_context;
+};
+
+struct ScratchBuffer
+{
+    typedef char Type;
+    static constexpr bool COUNTED = false;
+    static Type* create() {return new char[CHUNK_SIZE];}
+    static bool reset(Type*) {return true;}
+    static void destroy(Type* buffer) {delete[] buffer;}
+};
+
+// inflateReset keeps the input and output pointers, they are cleared too
+template<typename Stream>
+static void clearInflateBuffers(Stream* zstrm)
+{
+    zstrm->avail_in = 0;
+    zstrm->next_in = nullptr;
+    zstrm->avail_out = 0;
+    zstrm->next_out = nullptr;
+}
+
+template<typename Stream>
+static void initInflate(Stream* zstrm)
+{
+    zstrm->zalloc = nullptr;
+    zstrm->zfree = nullptr;
+    zstrm->opaque = nullptr;
+    clearInflateBuffers(zstrm);
+}
+
+struct ZlibInflate
+{
+    typedef z_stream Type;
+    static constexpr bool COUNTED = true;
+    static int inflate(Type* zstrm) {return ::inflate(zstrm, Z_NO_FLUSH);}
+
+    static Type* create()
+    {
+        std::unique_ptr<Type> zstrm(new Type);
+        initInflate(zstrm.get());
+        if (inflateInit(zstrm.get()) != Z_OK) {
+            throw std::runtime_error("Failed to initialize zlib");
+        }
+        return zstrm.release();
+    }
+
+    static bool reset(Type* zstrm)
+    {
+        clearInflateBuffers(zstrm);
+        return inflateReset(zstrm) == Z_OK;
+    }
+
+    static void destroy(Type* zstrm)
+    {
+        inflateEnd(zstrm);
+        delete zstrm;
+    }
+};
+
+#ifdef SAINTS_HAVE_ZLIB_NG
+struct ZlibNgInflate
+{
+    typedef zng_stream Type;
+    static constexpr bool COUNTED = true;
+    static int inflate(Type* zstrm) {return zng_inflate(zstrm, Z_NO_FLUSH);}
+
+    static Type* create()
+    {
+        std::unique_ptr<Type> zstrm(new Type);
+        initInflate(zstrm.get());
+        if (zng_inflateInit(zstrm.get()) != Z_OK) {
+            throw std::runtime_error("Failed to initialize zlib-ng");
+        }
+        return zstrm.release();
+    }
+
+    static bool reset(Type* zstrm)
+    {
+        clearInflateBuffers(zstrm);
+        return zng_inflateReset(zstrm) == Z_OK;
+    }
+
+    static void destroy(Type* zstrm)
+    {
+        zng_inflateEnd(zstrm);
+        delete zstrm;
+    }
+};
+#endif
+
+#ifdef SAINTS_HAVE_LIBDEFLATE
+struct LibdeflateInflate
+{
+    typedef libdeflate_decompressor Type;
+    static constexpr bool COUNTED = true;
+
+    static Type* create()
+    {
+        Type* decompressor = libdeflate_alloc_decompressor();
+        if (!decompressor) {
+            throw std::bad_alloc();
+        }
+        return decompressor;
+    }
+
+    // Decompressors keep no state between calls
+    static bool reset(Type*) {return true;}
+    static void destroy(Type* decompressor) {libdeflate_free_decompressor(decompressor);}
+};
+#endif
+
+struct LZ4Decompress
+{
+    typedef LZ4F_dctx Type;
+    static constexpr bool COUNTED = true;
+
+    static Type* create()
+    {
+        LZ4F_dctx* dctx = nullptr;
+        size_t dctx_status = LZ4F_createDecompressionContext(&dctx, LZ4F_VERSION);
+        if (LZ4F_isError(dctx_status)) {
+            throw std::runtime_error("Failed to initialize lz4");
+        }
+        return dctx;
+    }
+
+    // Also recovers contexts that stopped in the middle of a frame
+    static bool reset(Type* dctx)
+    {
+        LZ4F_resetDecompressionContext(dctx);
+        return true;
+    }
+
+    static void destroy(Type* dctx) {LZ4F_freeDecompressionContext(dctx);}
+};
+
+template<typename Stream>
+static void setInflateInput(Stream* zstrm, const char* data, quint32 size)
+{
+    zstrm->avail_in = size;
+    zstrm->next_in = reinterpret_cast<decltype(zstrm->next_in)>(const_cast<char*>(data));
+}
+
+template<typename Stream>
+static void setInflateOutput(Stream* zstrm, char* data, quint32 size)
+{
+    zstrm->avail_out = size;
+    zstrm->next_out = reinterpret_cast<decltype(zstrm->next_out)>(data);
+}
+
+static void checkInflate(int ret)
+{
+    assert(ret != Z_STREAM_ERROR);
+    switch (ret) {
+    case Z_NEED_DICT:
+    case Z_DATA_ERROR:
+        throw ParsingError("Invalid compression data");
+    case Z_MEM_ERROR:
+        throw std::bad_alloc();
+    }
+}
+
+static void checkStreamEnd(bool ended, qint64 in_pos, qint64 in_size)
+{
+    if (!ended || in_pos != in_size) {
+        throw ParsingError(QString("Compressed data doesn't end after %1 bytes")
+            .arg(in_size));
     }
+}
+
+template<typename Codec>
+static qint64 inflateStream(typename Codec::Type& zstrm,
+    const ReadCallback& read, const WriteCallback& write)
+{
+    ContextLease<ScratchBuffer> in_buffer;
+    ContextLease<ScratchBuffer> out_buffer;
+
+    int ret;
+    qint64 total_read = 0;
 
     do {
-        qint64 bytes_read = stream.read(in_buffer.data(), CHUNK_SIZE);
+        qint64 bytes_read = read(in_buffer.get(), CHUNK_SIZE);
         if (bytes_read == -1) {
-            inflateEnd(&zstrm);
             throw IOError("Error reading input file");
         }
         if (bytes_read == 0) {
-            break;
+            return -1;
         }
-        zstrm.avail_in = bytes_read;
-        zstrm.next_in = reinterpret_cast<unsigned char*>(in_buffer.data());
+        total_read += bytes_read;
+        setInflateInput(&zstrm, in_buffer.get(), bytes_read);
 
         do {
-            zstrm.avail_out = CHUNK_SIZE;
-            zstrm.next_out = reinterpret_cast<unsigned char*>(out_buffer.data());
-            ret = inflate(&zstrm, Z_NO_FLUSH);
-            assert(ret != Z_STREAM_ERROR);
-            switch (ret) {
-            case Z_NEED_DICT:
-            case Z_DATA_ERROR:
-                inflateEnd(&zstrm);
-                throw ParsingError("Invalid compression data");
-            case Z_MEM_ERROR:
-                inflateEnd(&zstrm);
-                throw std::bad_alloc();
-            }
+            setInflateOutput(&zstrm, out_buffer.get(), CHUNK_SIZE);
+            ret = Codec::inflate(&zstrm);
+            checkInflate(ret);
             qint64 out_len = CHUNK_SIZE - zstrm.avail_out;
-            out_data.append(out_buffer.data(), out_len);
+            if (!write(out_buffer.get(), out_len)) {
+                return total_read - zstrm.avail_in;
+            }
         } while (zstrm.avail_out == 0);
     } while (ret != Z_STREAM_END);
 
-    inflateEnd(&zstrm);
-    return out_data;
+    return total_read - zstrm.avail_in;
+}
+
+template<typename Codec>
+static qint64 inflateStream(const ReadCallback& read, const WriteCallback& write)
+{
+    ContextLease<Codec> context;
+    return inflateStream<Codec>(*context.get(), read, write);
+}
+
+template<typename Codec>
+static qint64 inflateStream(const ReadCallback& read, char* out, qint64 out_size)
+{
+    ContextLease<ScratchBuffer> in_buffer;
+
+    int ret = Z_OK;
+    ContextLease<Codec> context;
+    typename Codec::Type& zstrm = *context.get();
+
+    qint64 out_pos = 0;
+    while (ret != Z_STREAM_END && out_pos < out_size) {
+        if (zstrm.avail_in == 0) {
+            qint64 bytes_read = read(in_buffer.get(), CHUNK_SIZE);
+            if (bytes_read == -1) {
+                throw IOError("Error reading input file");
+            }
+            if (bytes_read == 0) {
+                break;
+            }
+            setInflateInput(&zstrm, in_buffer.get(), bytes_read);
+        }
+
+        // avail_out is only 32 bits wide
+        quint32 out_len = qMin<qint64>(out_size - out_pos, std::numeric_limits<quint32>::max());
+        setInflateOutput(&zstrm, out + out_pos, out_len);
+        ret = Codec::inflate(&zstrm);
+        checkInflate(ret);
+        out_pos += out_len - zstrm.avail_out;
+    }
+    return out_pos;
+}
+
+template<typename Codec>
+static qint64 inflateBuffer(const char* in, qint64 in_size, char* out, qint64 out_size,
+    bool partial)
+{
+    int ret = Z_OK;
+    ContextLease<Codec> context;
+    typename Codec::Type& zstrm = *context.get();
+
+    // avail_in and avail_out are only 32 bits wide
+    qint64 in_pos = 0;
+    qint64 out_pos = 0;
+    while (ret != Z_STREAM_END) {
+        quint32 in_len = qMin<qint64>(in_size - in_pos, std::numeric_limits<quint32>::max());
+        quint32 out_len = qMin<qint64>(out_size - out_pos, std::numeric_limits<quint32>::max());
+        if (in_len == 0 || (partial && out_len == 0)) {
+            break;
+        }
+        setInflateInput(&zstrm, in + in_pos, in_len);
+        setInflateOutput(&zstrm, out + out_pos, out_len);
+        ret = Codec::inflate(&zstrm);
+        checkInflate(ret);
+        in_pos += in_len - zstrm.avail_in;
+        out_pos += out_len - zstrm.avail_out;
+        if (ret == Z_BUF_ERROR) {
+            break; // Output is full
+        }
+    }
+
+    if (!partial) {
+        checkStreamEnd(ret == Z_STREAM_END, in_pos, in_size);
+    }
+    return out_pos;
+}
+
+#ifdef SAINTS_HAVE_LIBDEFLATE
+static qint64 inflateLibdeflate(const char* in, qint64 in_size, char* out, qint64 out_size)
+{
+    ContextLease<LibdeflateInflate> decompressor;
+
+    size_t in_len = 0;
+    size_t out_len = 0;
+    libdeflate_result ret = libdeflate_zlib_decompress_ex(
+        decompressor.get(), in, in_size, out, out_size, &in_len, &out_len);
+
+    if (ret == LIBDEFLATE_BAD_DATA) {
+        throw ParsingError("Invalid compression data");
+    }
+    // Insufficient space means there is more data than expected
+    checkStreamEnd(ret == LIBDEFLATE_SUCCESS, in_len, in_size);
+    return out_len;
+}
+#endif
+
+// libdeflate can only inflate whole buffers, streams use the next best one
+static bool useZlibNg()
+{
+#ifdef SAINTS_HAVE_ZLIB_NG
+    return getDeflateBackend() != DeflateBackend::Zlib;
+#else
+    return false;
+#endif
+}
+
+qint64 decompressZLIB(const ReadCallback& read, const WriteCallback& write)
+{
+#ifdef SAINTS_HAVE_ZLIB_NG
+    if (useZlibNg()) {
+        return inflateStream<ZlibNgInflate>(read, write);
+    }
+#endif
+    return inflateStream<ZlibInflate>(read, write);
+}
+
+qint64 decompressZLIB(const ReadCallback& read, char* out, qint64 out_size)
+{
+#ifdef SAINTS_HAVE_ZLIB_NG
+    if (useZlibNg()) {
+        return inflateStream<ZlibNgInflate>(read, out, out_size);
+    }
+#endif
+    return inflateStream<ZlibInflate>(read, out, out_size);
+}
+
+qint64 decompressZLIB(const char* in, qint64 in_size, char* out, qint64 out_size,
+    bool partial)
+{
+#ifdef SAINTS_HAVE_LIBDEFLATE
+    // Partial output would be reported as insufficient space
+    if (!partial && getDeflateBackend() == DeflateBackend::Libdeflate) {
+        return inflateLibdeflate(in, in_size, out, out_size);
+    }
+#endif
+#ifdef SAINTS_HAVE_ZLIB_NG
+    if (useZlibNg()) {
+        return inflateBuffer<ZlibNgInflate>(in, in_size, out, out_size, partial);
+    }
+#endif
+    return inflateBuffer<ZlibInflate>(in, in_size, out, out_size, partial);
+}
+
+const InflateCheckpoint* InflateIndex::find(qint64 out_pos) const
+{
+    auto it = std::upper_bound(points.begin(), points.end(), out_pos,
+        [](qint64 pos, const InflateCheckpoint& point) {
+            return pos < point.out_pos;
+        });
+    if (it == points.begin()) {
+        return nullptr;
+    }
+    return &*(it - 1);
+}
+
+InflateIndex buildInflateIndex(const ReadCallback& read, qint64 interval)
+{
+    ContextLease<ScratchBuffer> in_buffer;
+    // Output goes round robin through the window, only the history matters
+    QByteArray window(INFLATE_WINDOW_SIZE, 0);
+
+    ContextLease<ZlibInflate> context;
+    z_stream& zstrm = *context.get();
+    setInflateOutput(&zstrm, window.data(), INFLATE_WINDOW_SIZE);
+
+    InflateIndex index;
+    index.interval = interval;
+    qint64 total_in = 0;
+    qint64 total_out = 0;
+    qint64 last_out = 0;
+    int ret;
+    do {
+        if (zstrm.avail_in == 0) {
+            qint64 bytes_read = read(in_buffer.get(), CHUNK_SIZE);
+            if (bytes_read == -1) {
+                throw IOError("Error reading input file");
+            }
+            if (bytes_read == 0) {
+                throw ParsingError("Compressed data ended early");
+            }
+            setInflateInput(&zstrm, in_buffer.get(), bytes_read);
+        }
+        if (zstrm.avail_out == 0) {
+            setInflateOutput(&zstrm, window.data(), INFLATE_WINDOW_SIZE);
+        }
+
+        total_in += zstrm.avail_in;
+        total_out += zstrm.avail_out;
+        ret = inflate(&zstrm, Z_BLOCK);
+        checkInflate(ret);
+        total_in -= zstrm.avail_in;
+        total_out -= zstrm.avail_out;
+
+        // Inflating can only resume at the end of a block that isn't the last
+        bool block_end = (zstrm.data_type & 128) && !(zstrm.data_type & 64);
+        if (ret != Z_STREAM_END && block_end && total_out - last_out >= interval) {
+            InflateCheckpoint point;
+            point.out_pos = total_out;
+            point.in_pos = total_in;
+            point.bits = zstrm.data_type & 7;
+            point.prime = point.bits ? (zstrm.next_in[-1] >> (8 - point.bits)) : 0;
+            qint64 left = zstrm.avail_out;
+            point.window.resize(INFLATE_WINDOW_SIZE);
+            memcpy(point.window.data(), window.constData() + INFLATE_WINDOW_SIZE - left, left);
+            memcpy(point.window.data() + left, window.constData(), INFLATE_WINDOW_SIZE - left);
+            index.points.push_back(point);
+            last_out = total_out;
+        }
+    } while (ret != Z_STREAM_END);
+
+    return index;
+}
+
+void inflateFrom(const InflateCheckpoint& point, const ReadCallback& read,
+    const WriteCallback& write)
+{
+    // The zlib header is behind us, the rest is raw deflate data
+    z_stream zstrm;
+    initInflate(&zstrm);
+    if (inflateInit2(&zstrm, -MAX_WBITS) != Z_OK) {
+        throw std::runtime_error("Failed to initialize zlib");
+    }
+    std::unique_ptr<z_stream, int (*)(z_stream*)> guard(&zstrm, inflateEnd);
+
+    if (point.bits && inflatePrime(&zstrm, point.bits, point.prime) != Z_OK) {
+        throw ParsingError("Invalid inflate checkpoint");
+    }
+    int ret = inflateSetDictionary(&zstrm,
+        reinterpret_cast<const Bytef*>(point.window.constData()), point.window.size());
+    if (ret != Z_OK) {
+        throw ParsingError("Invalid inflate checkpoint");
+    }
+
+    inflateStream<ZlibInflate>(zstrm, read, write);
 }
 
 static int getLZ4BlockSize(const LZ4F_frameInfo_t* info) {
@@ -83,38 +691,34 @@ static int getLZ4BlockSize(const LZ4F_frameInfo_t* info) {
     }
 }
 
-QByteArray decompressLZ4(QIODevice& stream)
+qint64 decompressLZ4(const ReadCallback& read, const WriteCallback& write)
 {
-    QByteArray out_data;
-
-    QByteArray in_buffer(CHUNK_SIZE, 0);
-    char* in_ptr_init = in_buffer.data();
+    ContextLease<ScratchBuffer> in_buffer;
+    char* in_ptr_init = in_buffer.get();
     QByteArray out_buffer;
     char* out_ptr;
     int out_capacity = 0;
 
-    LZ4F_dctx* dctx = nullptr;
-    int ret = 1;
-
-    int dctx_status = LZ4F_createDecompressionContext(&dctx, 100);
-    if (LZ4F_isError(dctx_status)) {
-        throw std::runtime_error("Failed to initialize lz4");
-    }
+    ContextLease<LZ4Decompress> context;
+    LZ4F_dctx* dctx = context.get();
+    size_t ret = 1;
+    size_t in_len = 0;
+    qint64 total_read = 0;
 
     while (ret != 0) {
         char* in_ptr = in_ptr_init;
-        size_t in_len = stream.read(in_ptr, CHUNK_SIZE);
-        if (in_len < 1) {
-            LZ4F_freeDecompressionContext(dctx);
+        qint64 bytes_read = read(in_ptr, CHUNK_SIZE);
+        if (bytes_read < 1) {
             throw ParsingError("Error reading input data");
         }
+        total_read += bytes_read;
+        in_len = bytes_read;
 
         if (out_buffer.isNull()) {
             LZ4F_frameInfo_t info;
             size_t in_consumed = in_len;
             ret = LZ4F_getFrameInfo(dctx, &info, in_ptr, &in_consumed);
             if (LZ4F_isError(ret)) {
-                LZ4F_freeDecompressionContext(dctx);
                 throw ParsingError("Failed to read frame info");
             }
             out_capacity = getLZ4BlockSize(&info);
@@ -129,17 +733,389 @@ QByteArray decompressLZ4(QIODevice& stream)
             size_t in_consumed = in_len;
             ret = LZ4F_decompress(dctx, out_ptr, &out_len, in_ptr, &in_consumed, nullptr);
             if (LZ4F_isError(ret)) {
-                LZ4F_freeDecompressionContext(dctx);
                 throw ParsingError("Invalid compression data");
             }
 
-            out_data.append(out_ptr, out_len);
             in_ptr += in_consumed;
             in_len -= in_consumed;
+            if (!write(out_ptr, out_len)) {
+                return total_read - in_len;
+            }
+        }
+    }
+    return total_read - in_len;
+}
+
+qint64 decompressLZ4(const ReadCallback& read, char* out, qint64 out_size)
+{
+    ContextLease<ScratchBuffer> in_buffer;
+    const char* in_ptr = nullptr;
+    size_t in_len = 0;
+
+    ContextLease<LZ4Decompress> context;
+    LZ4F_dctx* dctx = context.get();
+    size_t ret = 1;
+
+    // Blocks are decoded straight into out while it has room for them
+    qint64 out_pos = 0;
+    while (ret != 0 && out_pos < out_size) {
+        if (in_len == 0) {
+            qint64 bytes_read = read(in_buffer.get(), CHUNK_SIZE);
+            if (bytes_read == -1) {
+                throw IOError("Error reading input file");
+            }
+            if (bytes_read == 0) {
+                break;
+            }
+            in_ptr = in_buffer.get();
+            in_len = bytes_read;
+        }
+
+        size_t out_len = out_size - out_pos;
+        size_t in_consumed = in_len;
+        ret = LZ4F_decompress(dctx, out + out_pos, &out_len, in_ptr, &in_consumed, nullptr);
+        if (LZ4F_isError(ret)) {
+            throw ParsingError("Invalid compression data");
+        }
+
+        in_ptr += in_consumed;
+        in_len -= in_consumed;
+        out_pos += out_len;
+    }
+    return out_pos;
+}
+
+qint64 decompressLZ4(const char* in, qint64 in_size, char* out, qint64 out_size,
+    bool partial)
+{
+    ContextLease<LZ4Decompress> context;
+    LZ4F_dctx* dctx = context.get();
+    size_t ret = 1;
+
+    qint64 in_pos = 0;
+    qint64 out_pos = 0;
+    while (ret != 0) {
+        if (in_pos == in_size || (partial && out_pos == out_size)) {
+            break;
+        }
+        size_t in_len = in_size - in_pos;
+        size_t out_len = out_size - out_pos;
+        ret = LZ4F_decompress(dctx, out + out_pos, &out_len, in + in_pos, &in_len, nullptr);
+        if (LZ4F_isError(ret)) {
+            throw ParsingError("Invalid compression data");
+        }
+        in_pos += in_len;
+        out_pos += out_len;
+        if (in_len == 0 && out_len == 0) {
+            break; // Output is full
+        }
+    }
+
+    if (!partial) {
+        checkStreamEnd(ret == 0, in_pos, in_size);
+    }
+    return out_pos;
+}
+
+void byteSwap32(char* data, qint64 count)
+{
+    qint64 i = 0;
+#ifdef SAINTS_HAVE_SSE2
+    // Swap the 16 bit halves, then the bytes within them
+    for (; i + 4 <= count; i += 4) {
+        __m128i* ptr = reinterpret_cast<__m128i*>(data + i * 4);
+        __m128i words = _mm_loadu_si128(ptr);
+        words = _mm_shufflelo_epi16(words, _MM_SHUFFLE(2, 3, 0, 1));
+        words = _mm_shufflehi_epi16(words, _MM_SHUFFLE(2, 3, 0, 1));
+        words = _mm_or_si128(_mm_slli_epi16(words, 8), _mm_srli_epi16(words, 8));
+        _mm_storeu_si128(ptr, words);
+    }
+#endif
+    for (; i < count; i++) {
+        quint32 word;
+        memcpy(&word, data + i * 4, 4);
+        word = swapBytes(word);
+        memcpy(data + i * 4, &word, 4);
+    }
+}
+
+quint32 updateCRC32(quint32 crc, const char* data, qint64 size)
+{
+    // crc32 takes at most 32 bits of length at once
+    while (size > 0) {
+        uInt len = qMin<qint64>(size, std::numeric_limits<uInt>::max());
+        crc = crc32(crc, reinterpret_cast<const Bytef*>(data), len);
+        data += len;
+        size -= len;
+    }
+    return crc;
+}
+
+struct LZ4Block
+{
+    qint64 in_pos;
+    qint64 in_size;
+    bool compressed;
+};
+
+// Finds the blocks of a single frame with independent blocks and no
+// checksums, returns false for anything the serial decoder has to handle
+static bool scanLZ4Frame(const char* in, qint64 in_size, qint64* block_max,
+    QVector<LZ4Block>* blocks)
+{
+    const uchar* data = reinterpret_cast<const uchar*>(in);
+    if (in_size < LZ4_FRAME_HEADER_MIN ||
+        qFromLittleEndian<quint32>(data) != LZ4F_MAGICNUMBER)
+    {
+        return false;
+    }
+
+    quint8 flags = data[4];
+    quint8 block_desc = data[5];
+    if ((flags >> 6) != 1 || // Version
+        !(flags & LZ4_FLAG_BLOCK_INDEPENDENT) ||
+        (flags & (LZ4_FLAG_BLOCK_CHECKSUM | LZ4_FLAG_CONTENT_CHECKSUM | LZ4_FLAG_DICT_ID)))
+    {
+        return false;
+    }
+
+    switch ((block_desc >> 4) & 0x7) {
+        case 4: *block_max = 1 << 16; break;
+        case 5: *block_max = 1 << 18; break;
+        case 6: *block_max = 1 << 20; break;
+        case 7: *block_max = 1 << 22; break;
+        default: return false;
+    }
+
+    qint64 pos = LZ4_FRAME_HEADER_MIN;
+    if (flags & LZ4_FLAG_CONTENT_SIZE) {
+        pos += 8;
+    }
+
+    while (pos + 4 <= in_size) {
+        quint32 block_size = qFromLittleEndian<quint32>(data + pos);
+        pos += 4;
+        if (block_size == 0) {
+            // The frame has to be the whole input
+            return pos == in_size;
+        }
+
+        LZ4Block block;
+        block.in_pos = pos;
+        block.in_size = block_size & 0x7FFFFFFF;
+        block.compressed = !(block_size & 0x80000000);
+        if (block.in_size > *block_max || pos + block.in_size > in_size) {
+            return false;
+        }
+        blocks->push_back(block);
+        pos += block.in_size;
+    }
+    return false;
+}
+
+qint64 decompressLZ4Parallel(const char* in, qint64 in_size, char* out, qint64 out_size,
+    int num_threads)
+{
+    qint64 block_max;
+    QVector<LZ4Block> blocks;
+    if (out_size < PARALLEL_LZ4_MIN_SIZE || resolveThreadCount(num_threads) < 2 ||
+        !scanLZ4Frame(in, in_size, &block_max, &blocks) || blocks.size() < 2 ||
+        (blocks.size() - 1) * block_max >= out_size ||
+        blocks.size() * block_max < out_size)
+    {
+        return decompressLZ4(in, in_size, out, out_size);
+    }
+
+    // Every block but the last one has to fill block_max bytes, otherwise
+    // the output offsets are unknown. The last one has to fill the rest of
+    // out_size exactly, so the blocks add up to out_size or a mismatch is
+    // reported.
+    QAtomicInt mismatch(0);
+    parallelFor(blocks.size(), num_threads, [&](int i) {
+        const LZ4Block& block = blocks.at(i);
+        qint64 out_pos = i * block_max;
+        qint64 capacity = qMin(block_max, out_size - out_pos);
+        qint64 out_len;
+        if (block.compressed) {
+            out_len = LZ4_decompress_safe(in + block.in_pos, out + out_pos,
+                block.in_size, capacity);
+        } else {
+            out_len = (block.in_size <= capacity) ? block.in_size : -1;
+            if (out_len >= 0) {
+                memcpy(out + out_pos, in + block.in_pos, block.in_size);
+            }
+        }
+        if (out_len != capacity) {
+            mismatch.storeRelease(1);
+        }
+    });
+
+    if (mismatch.loadAcquire()) {
+        // Short blocks or a wrong size, the serial decoder reports errors
+        return decompressLZ4(in, in_size, out, out_size);
+    }
+    return out_size;
+}
+
+static ReadCallback readFrom(const QByteArray& data)
+{
+    qint64 pos = 0;
+    return [&data, pos](char* out, qint64 size) mutable {
+        qint64 len = qMin(size, data.size() - pos);
+        memcpy(out, data.constData() + pos, len);
+        pos += len;
+        return len;
+    };
+}
+
+static ReadCallback readFrom(QIODevice& stream)
+{
+    return [&stream](char* data, qint64 size) {return stream.read(data, size);};
+}
+
+static qint64 getOutputSize(qint64 limit, qint64 size)
+{
+    qint64 out_size = (limit >= 0) ? qMin(limit, size) : size;
+    if (out_size > std::numeric_limits<int>::max()) {
+        throw ParsingError(QString("Decompressed size %1 is too large").arg(out_size));
+    }
+    return out_size;
+}
+
+static void checkOutputSize(qint64 produced, qint64 expected)
+{
+    if (produced < expected) {
+        throw ParsingError(QString("Compressed data ended after %1 of %2 bytes")
+            .arg(produced).arg(expected));
+    }
+}
+
+static WriteCallback appendTo(QByteArray& out_data, qint64 limit)
+{
+    return [&out_data, limit](const char* data, qint64 size) {
+        out_data.append(data, size);
+        if (limit >= 0 && out_data.size() >= limit) {
+            out_data.resize(limit);
+            return false;
         }
+        return true;
+    };
+}
+
+QByteArray decompressZLIB(QIODevice& stream, qint64 limit, qint64 size)
+{
+    QByteArray out_data;
+    if (size < 0) {
+        decompressZLIB(readFrom(stream), appendTo(out_data, limit));
+        return out_data;
+    }
+
+    out_data.resize(getOutputSize(limit, size));
+    qint64 produced = decompressZLIB(readFrom(stream), out_data.data(), out_data.size());
+    checkOutputSize(produced, out_data.size());
+    return out_data;
+}
+
+QByteArray decompressLZ4(QIODevice& stream, qint64 limit, qint64 size)
+{
+    QByteArray out_data;
+    if (size < 0) {
+        decompressLZ4(readFrom(stream), appendTo(out_data, limit));
+        return out_data;
+    }
+
+    out_data.resize(getOutputSize(limit, size));
+    qint64 produced = decompressLZ4(readFrom(stream), out_data.data(), out_data.size());
+    checkOutputSize(produced, out_data.size());
+    return out_data;
+}
+
+QByteArray decompressZLIB(const QByteArray& compressed, qint64 limit, qint64 size)
+{
+    QByteArray out_data;
+    if (size < 0) {
+        decompressZLIB(readFrom(compressed), appendTo(out_data, limit));
+        return out_data;
+    }
+
+    out_data.resize(getOutputSize(limit, size));
+    bool partial = (limit >= 0 && limit < size);
+    qint64 produced = decompressZLIB(compressed.constData(), compressed.size(),
+        out_data.data(), out_data.size(), partial);
+    checkOutputSize(produced, out_data.size());
+    return out_data;
+}
+
+QByteArray decompressLZ4(const QByteArray& compressed, qint64 limit, qint64 size,
+    int num_threads)
+{
+    QByteArray out_data;
+    if (size < 0) {
+        decompressLZ4(readFrom(compressed), appendTo(out_data, limit));
+        return out_data;
+    }
+
+    out_data.resize(getOutputSize(limit, size));
+    bool partial = (limit >= 0 && limit < size);
+    qint64 produced;
+    if (partial || num_threads == 1) {
+        produced = decompressLZ4(compressed.constData(), compressed.size(),
+            out_data.data(), out_data.size(), partial);
+    } else {
+        produced = decompressLZ4Parallel(compressed.constData(), compressed.size(),
+            out_data.data(), out_data.size(), num_threads);
+    }
+    checkOutputSize(produced, out_data.size());
+    return out_data;
+}
+
+QByteArray compressZLIB(const QByteArray& data, int level)
+{
+    if (level < 0) {
+        level = Z_DEFAULT_COMPRESSION;
+    }
+
+    uLongf out_len = compressBound(data.size());
+    QByteArray out_data(out_len, 0);
+    int ret = compress2(
+        reinterpret_cast<Bytef*>(out_data.data()), &out_len,
+        reinterpret_cast<const Bytef*>(data.constData()), data.size(),
+        level);
+    switch (ret) {
+    case Z_OK:
+        break;
+    case Z_MEM_ERROR:
+        throw std::bad_alloc();
+    default:
+        throw std::runtime_error("Failed to compress zlib data");
+    }
+
+    out_data.resize(out_len);
+    return out_data;
+}
+
+QByteArray compressLZ4(const QByteArray& data, int level)
+{
+    LZ4F_preferences_t prefs;
+    memset(&prefs, 0, sizeof(prefs));
+    // Independent blocks and a known content size make decoding cheaper
+    prefs.frameInfo.blockMode = LZ4F_blockIndependent;
+    prefs.frameInfo.contentSize = data.size();
+    if (level >= 0) {
+        prefs.compressionLevel = level;
+    }
+
+    size_t out_capacity = LZ4F_compressFrameBound(data.size(), &prefs);
+    QByteArray out_data(out_capacity, 0);
+    size_t ret = LZ4F_compressFrame(
+        out_data.data(), out_capacity,
+        data.constData(), data.size(),
+        &prefs);
+    if (LZ4F_isError(ret)) {
+        throw std::runtime_error("Failed to compress lz4 data");
     }
 
-    LZ4F_freeDecompressionContext(dctx);
+    out_data.resize(ret);
     return out_data;
 }
 
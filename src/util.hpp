@@ -1,7 +1,12 @@
 #pragma once
 #include <QtCore/QtGlobal>
 #include <QtCore/QByteArray>
+#include <QtCore/QString>
 #include <QtCore/QIODevice>
+#include <QtCore/QVector>
+#include <functional>
+#include <algorithm>
+#include <string.h>
 
 #define ARRAYSIZE(a) ((int)(sizeof(a) / sizeof(a[0])))
 
@@ -25,7 +30,100 @@ constexpr qint64 alignAddress(qint64 address, qint64 alignment)
     return (address + alignment - 1) / alignment * alignment;
 }
 
-QByteArray decompressZLIB(QIODevice& stream);
-QByteArray decompressLZ4(QIODevice& stream);
+// Reverses the byte order of an integer or float
+template<typename T>
+T swapBytes(T value)
+{
+    char bytes[sizeof(T)];
+    memcpy(bytes, &value, sizeof(T));
+    std::reverse(bytes, bytes + sizeof(T));
+    memcpy(&value, bytes, sizeof(T));
+    return value;
+}
+
+// Reverses the byte order of count 32 bit words in place
+void byteSwap32(char* data, qint64 count);
+
+// Returns the number of worker threads to use, 0 picks one per core
+int resolveThreadCount(int num_threads);
+// Calls func for every index in [0, count) on up to num_threads threads of
+// a pool shared by all calls, the calling thread included. The first
+// exception thrown by func is rethrown on the calling thread.
+void parallelFor(int count, int num_threads, const std::function<void(int)>& func);
+
+QString decodeCString(const QByteArray& buffer, qint64 offset);
+quint32 updateCRC32(quint32 crc, const char* data, qint64 size);
+
+// Updates the statistics returned by getDecompressionStats
+void countDecompressionContext(bool reused);
+
+// Reads up to size bytes into data, returns the number of bytes read, 0 at
+// the end of the input and -1 on errors
+typedef std::function<qint64(char* data, qint64 size)> ReadCallback;
+// Receives decompressed data, returning false stops decompression
+typedef std::function<bool(const char* data, qint64 size)> WriteCallback;
+
+// Returns the number of input bytes consumed, -1 if the input ended before
+// the compressed stream did
+qint64 decompressZLIB(const ReadCallback& read, const WriteCallback& write);
+qint64 decompressLZ4(const ReadCallback& read, const WriteCallback& write);
+// Decompresses into a caller provided buffer until it is full or the
+// compressed stream ends, returns the number of bytes written
+qint64 decompressZLIB(const ReadCallback& read, char* out, qint64 out_size);
+qint64 decompressLZ4(const ReadCallback& read, char* out, qint64 out_size);
+// Decompresses a complete compressed buffer into out. The stream has to end
+// exactly at in_size, partial decoding stops once out is full instead.
+qint64 decompressZLIB(const char* in, qint64 in_size, char* out, qint64 out_size,
+    bool partial = false);
+qint64 decompressLZ4(const char* in, qint64 in_size, char* out, qint64 out_size,
+    bool partial = false);
+// Decodes large frames with independent blocks on num_threads threads (0 =
+// one per core), other frames are decoded serially
+qint64 decompressLZ4Parallel(const char* in, qint64 in_size, char* out, qint64 out_size,
+    int num_threads = 0);
+
+// History needed to resume inflating at a checkpoint
+constexpr qint64 INFLATE_WINDOW_SIZE = 32768;
+
+// Position in a zlib stream to resume inflating from, at a block boundary
+struct InflateCheckpoint
+{
+    qint64 out_pos; // Decompressed bytes before the checkpoint
+    qint64 in_pos; // Compressed bytes before the checkpoint
+    int bits; // Bits of the byte before in_pos that are still unused
+    int prime; // Value of those bits
+    QByteArray window; // Last 32 KiB of output before the checkpoint
+};
+
+struct InflateIndex
+{
+    qint64 interval;
+    QVector<InflateCheckpoint> points;
+
+    // Closest checkpoint at or before out_pos, nullptr for the stream start
+    const InflateCheckpoint* find(qint64 out_pos) const;
+};
+
+// Inflates the whole zlib stream once and records a checkpoint about every
+// interval bytes of output
+InflateIndex buildInflateIndex(const ReadCallback& read, qint64 interval);
+// Inflates from a checkpoint, read has to continue at its in_pos. write
+// receives the output after out_pos.
+void inflateFrom(const InflateCheckpoint& point, const ReadCallback& read,
+    const WriteCallback& write);
+
+// Decompression stops once limit bytes have been produced, -1 reads to the
+// end of the compressed stream. A known decompressed size allocates the
+// output once, -1 grows it as data comes in.
+QByteArray decompressZLIB(QIODevice& stream, qint64 limit = -1, qint64 size = -1);
+QByteArray decompressLZ4(QIODevice& stream, qint64 limit = -1, qint64 size = -1);
+QByteArray decompressZLIB(const QByteArray& compressed, qint64 limit = -1, qint64 size = -1);
+// Complete LZ4 frames of known size are decoded on num_threads threads
+QByteArray decompressLZ4(const QByteArray& compressed, qint64 limit = -1, qint64 size = -1,
+    int num_threads = 1);
+
+// A level of -1 selects the library default
+QByteArray compressZLIB(const QByteArray& data, int level = -1);
+QByteArray compressLZ4(const QByteArray& data, int level = -1);
 
 }